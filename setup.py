@@ -18,7 +18,10 @@ libav = ['avformat', 'avutil']
 # Playback
 libportaudio = ['portaudio']
 
-c_libs = libav + libportaudio
+# Native worker pool
+libpthread = ['pthread']
+
+c_libs = libav + libportaudio + libpthread
 
 
 setup(
@@ -40,7 +43,7 @@ setup(
         'License :: OSI Approved :: BSD License',
         'Operating System :: POSIX',
         'Programming Language :: C',
-        'Programming Language :: Python :: 3.3',
+        'Programming Language :: Python :: 3.5',
         'Topic :: Multimedia :: Sound/Audio'],
     ext_modules=[Extension(
         'audiolayer',
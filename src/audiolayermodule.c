@@ -1,19 +1,352 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libgen.h>
+#include <limits.h>
 #include <portaudio.h>
+#include <pthread.h>
 #include <Python.h>
 #include <stdio.h>
 #include <strings.h>
 #include <structmember.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 /**
  * Exception definitions.
  */
 static PyObject *NoMediaException;
 
+/**
+ * Definitions for the Picture class.
+ */
+/* An attached picture, which can be used without holding the GIL. */
+typedef struct {
+    AVBufferRef *buf;
+    enum AVCodecID codec_id;
+    int width;
+    int height;
+    AVDictionary *metadata;     /* The type is stored as comment */
+} PictureData;
+
+static void
+PictureData_free(PictureData *pictures, int nb_pictures)
+{
+    int i = 0;
+    for (; i < nb_pictures; i++) {
+        av_buffer_unref(&pictures[i].buf);
+        av_dict_free(&pictures[i].metadata);
+    }
+    free(pictures);
+}
+
+/* Guess the codec of an image from its magic number. */
+static enum AVCodecID
+picture_codec_id(const uint8_t *data, Py_ssize_t size)
+{
+    if (size >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        return AV_CODEC_ID_PNG;
+    }
+    if (size >= 3 && memcmp(data, "\xff\xd8\xff", 3) == 0) {
+        return AV_CODEC_ID_MJPEG;
+    }
+    if (size >= 4 && memcmp(data, "GIF8", 4) == 0) {
+        return AV_CODEC_ID_GIF;
+    }
+    if (size >= 2 && memcmp(data, "BM", 2) == 0) {
+        return AV_CODEC_ID_BMP;
+    }
+    return AV_CODEC_ID_NONE;
+}
+
+#define BE16(p) ((int)(p)[0] << 8 | (p)[1])
+#define BE32(p) ((int64_t)(p)[0] << 24 | (p)[1] << 16 | (p)[2] << 8 | (p)[3])
+#define LE16(p) ((int)(p)[1] << 8 | (p)[0])
+#define LE32(p) ((int32_t)((uint32_t)(p)[3] << 24 | (p)[2] << 16 | \
+                           (p)[1] << 8 | (p)[0]))
+
+/*
+ * Read the dimensions of an image from its header. Muxers refuse to write
+ * picture streams without them.
+ */
+static int
+picture_dimensions(const uint8_t *data, Py_ssize_t size,
+                   enum AVCodecID codec_id, int *width, int *height)
+{
+    int64_t w = 0;
+    int64_t h = 0;
+    switch (codec_id) {
+        case AV_CODEC_ID_PNG:
+            /* The IHDR chunk directly follows the signature. */
+            if (size >= 24 && memcmp(data + 12, "IHDR", 4) == 0) {
+                w = BE32(data + 16);
+                h = BE32(data + 20);
+            }
+            break;
+        case AV_CODEC_ID_MJPEG: {
+            /* Walk the segments until a start of frame marker. */
+            Py_ssize_t i = 2;
+            while (i + 9 <= size && data[i] == 0xff) {
+                uint8_t marker = data[i + 1];
+                if (marker == 0xff) {
+                    i++;
+                    continue;
+                }
+                if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 &&
+                        marker != 0xc8 && marker != 0xcc) {
+                    h = BE16(data + i + 5);
+                    w = BE16(data + i + 7);
+                    break;
+                }
+                if (marker == 0xd9 || marker == 0xda) {
+                    break;
+                }
+                i += 2 + BE16(data + i + 2);
+            }
+            break;
+        }
+        case AV_CODEC_ID_GIF:
+            if (size >= 10) {
+                w = LE16(data + 6);
+                h = LE16(data + 8);
+            }
+            break;
+        case AV_CODEC_ID_BMP:
+            if (size >= 26 && LE32(data + 14) == 12) {
+                /* OS/2 bitmap core header */
+                w = LE16(data + 18);
+                h = LE16(data + 20);
+            } else if (size >= 26) {
+                w = LE32(data + 18);
+                /* Top-down bitmaps have a negative height. */
+                h = LE32(data + 22);
+                h = h < 0 ? -h : h;
+            }
+            break;
+        default:
+            break;
+    }
+    if (w <= 0 || h <= 0 || w > INT_MAX || h > INT_MAX) {
+        return -1;
+    }
+    *width = (int)w;
+    *height = (int)h;
+    return 0;
+}
+
+typedef struct {
+    PyObject_HEAD
+    PictureData data;
+} Picture;
+
+static PyTypeObject PictureType;
+
+static void
+Picture_dealloc(Picture *self)
+{
+    av_buffer_unref(&self->data.buf);
+    av_dict_free(&self->data.metadata);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Create a Picture which takes over buf and metadata. */
+static PyObject *
+Picture_from_buffer(AVBufferRef *buf, enum AVCodecID codec_id,
+                    int width, int height, AVDictionary *metadata)
+{
+    Picture *self = (Picture *)PictureType.tp_alloc(&PictureType, 0);
+    if (self == NULL) {
+        av_buffer_unref(&buf);
+        av_dict_free(&metadata);
+        return NULL;
+    }
+    self->data.buf = buf;
+    self->data.codec_id = codec_id;
+    self->data.width = width;
+    self->data.height = height;
+    self->data.metadata = metadata;
+    return (PyObject *)self;
+}
+
+/* Create a Picture from a Picture or a copy of any bytes-like object. */
+static PyObject *
+Picture_from_object(PyObject *obj)
+{
+    if (PyObject_TypeCheck(obj, &PictureType)) {
+        Py_INCREF(obj);
+        return obj;
+    }
+    Py_buffer view;
+    if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    enum AVCodecID codec_id = picture_codec_id(view.buf, view.len);
+    if (codec_id == AV_CODEC_ID_NONE) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "Unsupported picture format.");
+        return NULL;
+    }
+    int width, height;
+    if (picture_dimensions(view.buf, view.len, codec_id,
+                           &width, &height) < 0) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError,
+                        "Unable to read the picture dimensions.");
+        return NULL;
+    }
+    if (view.len > INT_MAX - FF_INPUT_BUFFER_PADDING_SIZE) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "The picture is too large.");
+        return NULL;
+    }
+    AVBufferRef *buf = av_buffer_alloc(view.len +
+                                       FF_INPUT_BUFFER_PADDING_SIZE);
+    if (buf == NULL) {
+        PyBuffer_Release(&view);
+        return PyErr_NoMemory();
+    }
+    memcpy(buf->data, view.buf, view.len);
+    memset(buf->data + view.len, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    buf->size = view.len;
+    PyBuffer_Release(&view);
+    /* New pictures are front covers, unless their type is changed. */
+    AVDictionary *metadata = NULL;
+    if (av_dict_set(&metadata, "comment", "Cover (front)", 0) < 0) {
+        av_buffer_unref(&buf);
+        return PyErr_NoMemory();
+    }
+    return Picture_from_buffer(buf, codec_id, width, height, metadata);
+}
+
+/* Expose the packet data directly, without copying it. */
+static int
+Picture_getbuffer(Picture *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->data.buf->data,
+                             self->data.buf->size, 1, flags);
+}
+
+static PyObject *
+Picture_getmimetype(Picture *self, void *closure)
+{
+    switch (self->data.codec_id) {
+        case AV_CODEC_ID_PNG:
+            return PyUnicode_FromString("image/png");
+        case AV_CODEC_ID_MJPEG:
+            return PyUnicode_FromString("image/jpeg");
+        case AV_CODEC_ID_GIF:
+            return PyUnicode_FromString("image/gif");
+        case AV_CODEC_ID_BMP:
+            return PyUnicode_FromString("image/bmp");
+        default:
+            return PyUnicode_FromString("application/octet-stream");
+    }
+}
+
+/* Get a metadata value of the picture, the key is passed as closure. */
+static PyObject *
+Picture_getmetadata(Picture *self, void *closure)
+{
+    AVDictionaryEntry *tag = av_dict_get(self->data.metadata,
+                                         (const char *)closure, NULL, 0);
+    if (tag == NULL) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(tag->value);
+}
+
+static int
+Picture_setmetadata(Picture *self, PyObject *value, void *closure)
+{
+    char *char_value = NULL;
+    if (value != NULL && value != Py_None) {
+        if (!PyUnicode_Check(value)) {
+            PyErr_SetString(PyExc_TypeError, "Value must be a string");
+            return -1;
+        }
+        char_value = PyUnicode_AsUTF8(value);
+        if (char_value == NULL) {
+            return -1;
+        }
+    }
+    if (av_dict_set(&self->data.metadata, (const char *)closure,
+                    char_value, 0) < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(Picture_doc, "A picture attached to a song, such as cover art.\n\
+\n\
+A picture supports the buffer protocol. The image data is not copied or \
+decoded:\n\
+\n\
+>>> picture = song.pictures[0]\n\
+>>> picture.mime_type\n\
+'image/jpeg'\n\
+>>> picture.type\n\
+'Cover (front)'\n\
+>>> data = memoryview(picture)\n\
+>>>");
+PyDoc_STRVAR(Picture_mimetype__doc__, "The MIME type of the image.");
+PyDoc_STRVAR(Picture_type__doc__, "The ID3v2 picture type, such as \
+'Cover (front)' or 'Cover (back)'.\n\
+\n\
+Pictures created from bytes are front covers. The type is written when the \
+song is saved.");
+PyDoc_STRVAR(Picture_description__doc__, "The description of the picture.");
+
+static PyBufferProcs Picture_as_buffer = {
+    (getbufferproc)Picture_getbuffer,   /* bf_getbuffer */
+    0,                                  /* bf_releasebuffer */
+};
+
+static PyGetSetDef Picture_getseters[] = {
+    {"mime_type", (getter)Picture_getmimetype, NULL,
+     Picture_mimetype__doc__, NULL},
+    {"type", (getter)Picture_getmetadata, (setter)Picture_setmetadata,
+     Picture_type__doc__, "comment"},
+    {"description", (getter)Picture_getmetadata, (setter)Picture_setmetadata,
+     Picture_description__doc__, "title"},
+    {NULL}
+};
+
+static PyTypeObject PictureType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "audiolayer.Picture",           /* tp_name */
+    sizeof(Picture),                /* tp_basicsize */
+    0,                              /* tp_itemsize */
+    (destructor)Picture_dealloc,    /* tp_dealloc */
+    0,                              /* tp_print */
+    0,                              /* tp_getattr */
+    0,                              /* tp_setattr */
+    0,                              /* tp_reserved */
+    0,                              /* tp_repr */
+    0,                              /* tp_as_number */
+    0,                              /* tp_as_sequence */
+    0,                              /* tp_as_mapping */
+    0,                              /* tp_hash  */
+    0,                              /* tp_call */
+    0,                              /* tp_str */
+    0,                              /* tp_getattro */
+    0,                              /* tp_setattro */
+    &Picture_as_buffer,             /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,             /* tp_flags */
+    Picture_doc,                    /* tp_doc */
+    0,                              /* tp_traverse */
+    0,                              /* tp_clear */
+    0,                              /* tp_richcompare */
+    0,                              /* tp_weaklistoffset */
+    0,                              /* tp_iter */
+    0,                              /* tp_iternext */
+    0,                              /* tp_methods */
+    0,                              /* tp_members */
+    Picture_getseters,              /* tp_getset */
+};
+
 /**
  * Definitions for the Song class.
  */
@@ -24,15 +357,37 @@ typedef struct {
     PyObject *duration;
     PyObject *sample_rate;
     PyObject *channels;
+    PyObject *pictures;             /* Tuple of Picture, loaded lazily */
     /* av */
     AVFormatContext *fmt_ctx;
     AVStream *audio_stream;
     AVCodecContext *codec_ctx;
     AVDictionaryEntry *current_tag; /* Used for iteration: for tag in song */
+    int fd;                         /* The file read by the AVIO context */
     /* portaudio */
     PaStream *pa_stream;
+    /* worker pool */
+    int busy;                       /* Set while a job uses this song */
+    volatile int interrupted;       /* Set when that job is cancelled */
+    int close_pending;              /* Closed once that job is finished */
+    unsigned int generation;        /* Bumped when the file is read anew */
 } Song;
 
+static PyTypeObject SongType;
+
+#define Song_CHECK_BUSY(self, ret) \
+    if ((self)->busy) { \
+        PyErr_SetString(PyExc_RuntimeError, \
+                        "Another operation is in progress on this song."); \
+        return ret; \
+    }
+
+#define Song_CHECK_CLOSED(self, ret) \
+    if ((self)->fmt_ctx == NULL) { \
+        PyErr_SetString(PyExc_ValueError, "I/O operation on closed song."); \
+        return ret; \
+    }
+
 /* Required for cyclic garbage collection */
 static int
 Song_traverse(Song *self, visitproc visit, void *arg)
@@ -41,6 +396,7 @@ Song_traverse(Song *self, visitproc visit, void *arg)
     Py_VISIT(self->duration);
     Py_VISIT(self->sample_rate);
     Py_VISIT(self->channels);
+    Py_VISIT(self->pictures);
     return 0;
 }
 
@@ -51,19 +407,143 @@ Song_clear(Song *self)
     Py_CLEAR(self->duration);
     Py_CLEAR(self->sample_rate);
     Py_CLEAR(self->channels);
+    Py_CLEAR(self->pictures);
     return 0;
 }
 
+/**
+ * Pool of AVIO buffers shared by all songs.
+ *
+ * Songs read their file through an AVIO context on a pooled buffer, instead
+ * of letting avformat_open_input allocate a new buffer for every file. The
+ * pool is used by worker threads as well.
+ */
+#define IO_BUFFER_SIZE 32768
+#define IO_POOL_SIZE 16
+
+static struct {
+    pthread_mutex_t lock;
+    uint8_t *buffers[IO_POOL_SIZE];
+    int nb_buffers;
+} io_pool = {PTHREAD_MUTEX_INITIALIZER, {NULL}, 0};
+
+static uint8_t *
+io_pool_get(void)
+{
+    uint8_t *buffer = NULL;
+    pthread_mutex_lock(&io_pool.lock);
+    if (io_pool.nb_buffers > 0) {
+        buffer = io_pool.buffers[--io_pool.nb_buffers];
+    }
+    pthread_mutex_unlock(&io_pool.lock);
+    if (buffer == NULL) {
+        buffer = av_malloc(IO_BUFFER_SIZE);
+    }
+    return buffer;
+}
+
+/* AVIO may have replaced the buffer, so only buffers of the pool size fit. */
 static void
-Song_dealloc(Song* self)
+io_pool_put(uint8_t *buffer, int size)
+{
+    if (buffer == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&io_pool.lock);
+    if (size == IO_BUFFER_SIZE && io_pool.nb_buffers < IO_POOL_SIZE) {
+        io_pool.buffers[io_pool.nb_buffers++] = buffer;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&io_pool.lock);
+    av_free(buffer);
+}
+
+static void
+io_pool_clear(void)
+{
+    pthread_mutex_lock(&io_pool.lock);
+    while (io_pool.nb_buffers > 0) {
+        av_free(io_pool.buffers[--io_pool.nb_buffers]);
+    }
+    pthread_mutex_unlock(&io_pool.lock);
+}
+
+static int
+song_io_read(void *opaque, uint8_t *buf, int size)
+{
+    Song *self = (Song *)opaque;
+    if (self->interrupted) {
+        return AVERROR_EXIT;
+    }
+    ssize_t n = read(self->fd, buf, size);
+    if (n < 0) {
+        return AVERROR(errno);
+    }
+    return n == 0 ? AVERROR_EOF : (int)n;
+}
+
+static int64_t
+song_io_seek(void *opaque, int64_t offset, int whence)
+{
+    Song *self = (Song *)opaque;
+    if (whence == AVSEEK_SIZE) {
+        struct stat s;
+        return fstat(self->fd, &s) < 0 ? AVERROR(errno) : s.st_size;
+    }
+    off_t pos = lseek(self->fd, offset, whence & ~AVSEEK_FORCE);
+    return pos < 0 ? AVERROR(errno) : pos;
+}
+
+/* Free an AVIO context on a pooled buffer and close the file it reads. */
+static void
+song_io_close(Song *self, AVIOContext *pb)
+{
+    if (pb != NULL) {
+        io_pool_put(pb->buffer, pb->buffer_size);
+        av_free(pb);
+    }
+    if (self->fd >= 0) {
+        close(self->fd);
+        self->fd = -1;
+    }
+}
+
+/* Release the decoder and close the file, including its AVIO context. */
+static void
+song_close(Song *self)
 {
-    Song_clear(self);
     if (self->codec_ctx != NULL) {
         avcodec_close(self->codec_ctx);
+        self->codec_ctx = NULL;
     }
     if (self->fmt_ctx != NULL) {
-        avformat_free_context(self->fmt_ctx);
+        /* The AVIO context is not freed by closing the input. */
+        AVIOContext *pb = self->fmt_ctx->pb;
+        avformat_close_input(&self->fmt_ctx);
+        song_io_close(self, pb);
+    }
+    self->audio_stream = NULL;
+    self->current_tag = NULL;
+}
+
+/* Mark the song as idle, and close it if __exit__ deferred that. */
+static void
+song_release(Song *self)
+{
+    self->busy = 0;
+    self->interrupted = 0;
+    if (self->close_pending) {
+        self->close_pending = 0;
+        song_close(self);
     }
+}
+
+static void
+Song_dealloc(Song* self)
+{
+    PyObject_GC_UnTrack(self);
+    Song_clear(self);
+    song_close(self);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -73,6 +553,9 @@ Song_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     Song *self;
 
     self = (Song *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->fd = -1;
+    }
     return (PyObject *)self;
 }
 
@@ -86,14 +569,50 @@ test file provided in the test directory:\n\
 >>> song = Song('test.flac')\n\
 >>> song['artist']\n\
 Machinae Supremacy\n\
+>>>\n\
+\n\
+The file stays open until close is called or the song is garbage collected. \
+A song can also be used as a context manager:\n\
+\n\
+>>> with Song('test.flac') as song:\n\
+...     song['artist']\n\
+...\n\
+'Machinae Supremacy'\n\
 >>>");
 /* Method docstrings */
 PyDoc_STRVAR(Song_play__doc__, "Start or continue playing this song.");
+PyDoc_STRVAR(Song_close__doc__, "Close the file of this song.\n\
+\n\
+This releases the file descriptor and all decoding state. Afterwards only \
+the stream info and pictures which were already loaded can be read. Calling \
+close more than once is allowed.");
+PyDoc_STRVAR(Song_enter__doc__, "Return the song itself.");
+PyDoc_STRVAR(Song_exit__doc__, "Close the song.\n\
+\n\
+If a job still uses the song, it is closed once that job is finished.");
 PyDoc_STRVAR(Song_save__doc__, "Save the song with its metadata.\n\
 \n\
 This saves the song to a file with the newly set metadata.\n\
 \n\
 :key filename: The path to save the new file to.");
+PyDoc_STRVAR(Song_save_async__doc__, "Save the song without blocking.\n\
+\n\
+This does the same as save, but the file is written on the native worker \
+pool. An asyncio future is returned which resolves to None when the file \
+has been written. Cancelling the future aborts writing the file.\n\
+\n\
+:key filename: The path to save the new file to.");
+PyDoc_STRVAR(Song_blocks__doc__, "Decode the audio stream asynchronously.\n\
+\n\
+This returns an asynchronous iterator. Each iteration decodes the next block \
+of audio on the native worker pool and yields it as interleaved PCM bytes. \
+The samples have the format given by sample_format and bytes_per_sample. \
+Saving or playing the song, or decoding it again, makes the iterator raise \
+RuntimeError.\n\
+\n\
+>>> async for block in song.blocks():\n\
+...     process(block)\n\
+...");
 PyDoc_STRVAR(Song_print__doc__, "Prints all metadata of this song.\n\
 \n\
 The metadata will be printed in the form `key -> value\\n`. This is a \
@@ -108,46 +627,125 @@ PyDoc_STRVAR(Song_duration__doc__, "The duration of the file in seconds.");
 PyDoc_STRVAR(Song_samplerate__doc__, "The sample rate of the file.");
 PyDoc_STRVAR(Song_channels__doc__,
              "The number of audio channels of the file.");
+PyDoc_STRVAR(Song_closed__doc__, "Whether the song has been closed.");
+PyDoc_STRVAR(Song_busy__doc__, "Whether a job on the worker pool uses the \
+song.\n\
+\n\
+A cancelled job keeps the song busy until the worker has stopped it.");
+PyDoc_STRVAR(Song_sampleformat__doc__, "The format of decoded samples.\n\
+\n\
+This is the libav name of the interleaved sample format of the blocks \
+yielded by blocks, such as 's16', 's32' or 'flt'.");
+PyDoc_STRVAR(Song_bytespersample__doc__,
+             "The size of one decoded sample of one channel in bytes.");
+PyDoc_STRVAR(Song_pictures__doc__, "The pictures attached to the file.\n\
+\n\
+This is a tuple of Picture objects, which is created on first access. It can \
+be replaced by a sequence of Picture or bytes-like objects containing PNG, \
+JPEG, GIF or BMP images. These pictures are written when the song is saved.");
+
+/**
+ * Helpers which do not require the GIL.
+ *
+ * These are shared between the blocking methods, which release the GIL while
+ * calling them, and the jobs run on the native worker pool. Errors are stored
+ * in a SongError, which is turned into a Python exception afterwards.
+ */
+typedef struct {
+    int av_result;          /* Failed result of avformat_open_input */
+    int saved_errno;        /* errno belonging to path */
+    const char *message;    /* Message for an IOError */
+    char path[PATH_MAX];    /* The path an OS error refers to */
+} SongError;
+
+static void
+SongError_raise(SongError *err)
+{
+    if (err->av_result < 0) {
+        errno = err->saved_errno;
+        switch (err->av_result) {
+            case -1:
+                PyErr_SetFromErrnoWithFilename(PyExc_IsADirectoryError,
+                                               err->path);
+                return;
+            case -2:
+                PyErr_SetFromErrnoWithFilename(PyExc_FileNotFoundError,
+                                               err->path);
+                return;
+            case -1094995529:
+                PyErr_SetFromErrnoWithFilename(NoMediaException, err->path);
+                return;
+        }
+        PyErr_SetString(PyExc_RuntimeError,
+                        "An unknown exception has occurred.");
+        return;
+    }
+    if (err->path[0]) {
+        errno = err->saved_errno;
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, err->path);
+        return;
+    }
+    PyErr_SetString(PyExc_IOError, err->message);
+}
+
+/* Set by the tests to keep saves running until they are cancelled. */
+static volatile int hold_saves = 0;
 
+/* Interrupts blocking av calls made on behalf of a cancelled job. */
 static int
-Song_init(Song *self, PyObject *args, PyObject *kwds)
+Song_interrupt(void *opaque)
 {
-    /* Song has already been initialized */
-    if (self->filepath != NULL) {
-        PyErr_SetString(PyExc_UserWarning,
-                        "This song object has already been initialized.");
+    return ((Song *)opaque)->interrupted;
+}
+
+static int
+song_open(Song *self, const char *path, SongError *err)
+{
+    self->fmt_ctx = avformat_alloc_context();
+    if (self->fmt_ctx == NULL) {
+        err->message = "Unable to allocate format context.";
         return -1;
     }
-    PyObject *obj;
-    PyObject *tmp;
+    self->fmt_ctx->interrupt_callback.callback = Song_interrupt;
+    self->fmt_ctx->interrupt_callback.opaque = self;
 
-    if (!PyArg_ParseTuple(args, "U", &obj)) {
+    struct stat s;
+    self->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (self->fd >= 0 && fstat(self->fd, &s) == 0 && S_ISDIR(s.st_mode)) {
+        errno = EISDIR;
+        close(self->fd);
+        self->fd = -1;
+    }
+    if (self->fd < 0) {
+        err->saved_errno = errno;
+        snprintf(err->path, sizeof(err->path), "%s", path);
+        avformat_free_context(self->fmt_ctx);
+        self->fmt_ctx = NULL;
         return -1;
     }
-
-    char *str = PyUnicode_AsUTF8(obj);
-
-    if (obj) {
-        tmp = self->filepath;
-        Py_INCREF(obj);
-        self->filepath = obj;
-        Py_XDECREF(tmp);
+    uint8_t *buffer = io_pool_get();
+    AVIOContext *pb = NULL;
+    if (buffer != NULL) {
+        pb = avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, self,
+                                song_io_read, NULL, song_io_seek);
     }
-    int result = avformat_open_input(&self->fmt_ctx, str, NULL, NULL);
-    switch (result) {
-        case -1:
-            PyErr_SetFromErrnoWithFilename(PyExc_IsADirectoryError, str);
-            return -1;
-        case -2:
-            PyErr_SetFromErrnoWithFilename(PyExc_FileNotFoundError, str);
-            return -1;
-        case -1094995529:
-            PyErr_SetFromErrnoWithFilename(NoMediaException, str);
-            return -1;
+    if (pb == NULL) {
+        err->message = "Unable to allocate IO context.";
+        io_pool_put(buffer, IO_BUFFER_SIZE);
+        song_io_close(self, NULL);
+        avformat_free_context(self->fmt_ctx);
+        self->fmt_ctx = NULL;
+        return -1;
     }
+    self->fmt_ctx->pb = pb;
+
+    /* The context is freed by avformat_open_input on failure. */
+    int result = avformat_open_input(&self->fmt_ctx, path, NULL, NULL);
     if (result < 0) {
-        PyErr_SetString(PyExc_RuntimeError,
-                        "An unknown exception has occurred.");
+        err->av_result = result;
+        err->saved_errno = errno;
+        snprintf(err->path, sizeof(err->path), "%s", path);
+        song_io_close(self, pb);
         return -1;
     }
     /* This is 20 times the default, is this ok? */
@@ -155,7 +753,8 @@ Song_init(Song *self, PyObject *args, PyObject *kwds)
 
     /* This is required for formats with no header info. */
     if (avformat_find_stream_info(self->fmt_ctx, NULL) < 0) {
-        PyErr_SetString(PyExc_IOError, "Cannot find stream info.");
+        err->message = "Cannot find stream info.";
+        song_close(self);
         return -1;
     }
     unsigned int i = 0;
@@ -163,22 +762,1025 @@ Song_init(Song *self, PyObject *args, PyObject *kwds)
         if (self->fmt_ctx->streams[i]->codec->codec_type ==
                 AVMEDIA_TYPE_AUDIO) {
             self->audio_stream = self->fmt_ctx->streams[i];
-            break;
+            return 0;
         }
     }
-    if (self->audio_stream == NULL) {
-        PyErr_SetString(PyExc_IOError, "Cannot find audio stream.");
+    err->message = "Cannot find audio stream.";
+    song_close(self);
+    return -1;
+}
+
+/*
+ * Whether a picture can be attached in the output format. Muxers which do not
+ * know whether they support a codec are trusted if their default video codec
+ * is an image codec, as is the case for formats which support cover art.
+ */
+static int
+picture_supported(AVOutputFormat *o_fmt, PictureData *picture)
+{
+    int supported = avformat_query_codec(o_fmt, picture->codec_id,
+                                         FF_COMPLIANCE_NORMAL);
+    if (supported < 0) {
+        return o_fmt->video_codec == AV_CODEC_ID_PNG ||
+               o_fmt->video_codec == AV_CODEC_ID_MJPEG;
+    }
+    return supported;
+}
+
+static int
+song_write(Song *self, const char *filename, const char *tmpfile,
+           PictureData *pictures, int nb_pictures, SongError *err)
+{
+    struct stat s;
+    char dir[PATH_MAX];
+    int result = -1;
+
+    /* dirname may modify its argument, so it gets a copy. */
+    snprintf(dir, sizeof(dir), "%s", filename);
+    char *dir_name = dirname(dir);
+    if (stat(dir_name, &s)) {
+        err->saved_errno = errno;
+        snprintf(err->path, sizeof(err->path), "%s", dir_name);
         return -1;
     }
-    self->codec_ctx = self->audio_stream->codec;
-    self->duration = PyFloat_FromDouble((double)self->fmt_ctx->duration /
-                                         AV_TIME_BASE);
-    Py_INCREF(self->duration);
-    self->sample_rate = PyLong_FromLong(self->codec_ctx->sample_rate);
-    Py_INCREF(self->sample_rate);
-    self->channels = PyLong_FromLong(self->codec_ctx->channels);
-    Py_INCREF(self->channels);
-    return 0;
+
+    AVOutputFormat *o_fmt = av_guess_format(self->fmt_ctx->iformat->name,
+                                            filename, NULL);
+    if (!o_fmt) {
+        err->message = "Unable to detect output format.";
+        return -1;
+    }
+    AVFormatContext *o_fmt_ctx = avformat_alloc_context();
+    if (!o_fmt_ctx) {
+        err->message = "Unable to allocate output format context.";
+        return -1;
+    }
+    o_fmt_ctx->oformat = o_fmt;
+    o_fmt_ctx->interrupt_callback.callback = Song_interrupt;
+    o_fmt_ctx->interrupt_callback.opaque = self;
+    if (!(o_fmt->flags & AVFMT_NOFILE)) {
+        if (avio_open2(&(o_fmt_ctx->pb), tmpfile, AVIO_FLAG_WRITE,
+                       &o_fmt_ctx->interrupt_callback, NULL) < 0) {
+            err->message = "Unable to open temporary output file.";
+            goto end;
+        }
+    }
+    AVStream *o_stream = avformat_new_stream(o_fmt_ctx, NULL);
+    if (!o_stream) {
+        err->message = "Unable to allocate output stream.";
+        goto end;
+    }
+    AVStream *i_stream = self->audio_stream;
+    o_stream->id = i_stream->id;
+    o_stream->disposition = i_stream->disposition;
+    o_stream->codec->bits_per_raw_sample =
+        i_stream->codec->bits_per_raw_sample;
+    o_stream->codec->chroma_sample_location =
+        i_stream->codec->chroma_sample_location;
+    o_stream->codec->codec_id = i_stream->codec->codec_id;
+    o_stream->codec->codec_type = i_stream->codec->codec_type;
+    o_stream->codec->codec_tag = i_stream->codec->codec_tag;
+    o_stream->codec->bit_rate = i_stream->codec->bit_rate;
+    o_stream->codec->rc_max_rate = i_stream->codec->rc_max_rate;
+    o_stream->codec->rc_buffer_size = i_stream->codec->rc_buffer_size;
+    o_stream->codec->field_order = i_stream->codec->field_order;
+    uint64_t extra_size = (uint64_t)i_stream->codec->extradata_size +
+        FF_INPUT_BUFFER_PADDING_SIZE;
+    if (extra_size > INT_MAX) {
+        err->message = "Codec extradata is too large.";
+        goto end;
+    }
+    o_stream->codec->extradata = av_mallocz(extra_size);
+    if (!o_stream->codec->extradata) {
+        err->message = "Unable to allocate codec extradata.";
+        goto end;
+    }
+    memcpy(o_stream->codec->extradata, i_stream->codec->extradata,
+           i_stream->codec->extradata_size);
+    o_stream->codec->extradata_size = i_stream->codec->extradata_size;
+    o_stream->codec->time_base = i_stream->time_base;
+
+    /* Audio specific */
+    o_stream->codec->channel_layout = i_stream->codec->channel_layout;
+    o_stream->codec->sample_rate = i_stream->codec->sample_rate;
+    o_stream->codec->channels = i_stream->codec->channels;
+    o_stream->codec->frame_size = i_stream->codec->frame_size;
+    o_stream->codec->audio_service_type = i_stream->codec->audio_service_type;
+    o_stream->codec->block_align = i_stream->codec->block_align;
+
+    /* Attached pictures */
+    int i = 0;
+    for (; i < nb_pictures; i++) {
+        if (!picture_supported(o_fmt, &pictures[i])) {
+            continue;
+        }
+        AVStream *o_picture = avformat_new_stream(o_fmt_ctx, NULL);
+        if (!o_picture) {
+            err->message = "Unable to allocate picture stream.";
+            goto end;
+        }
+        o_picture->disposition = AV_DISPOSITION_ATTACHED_PIC;
+        o_picture->codec->codec_type = AVMEDIA_TYPE_VIDEO;
+        o_picture->codec->codec_id = pictures[i].codec_id;
+        o_picture->codec->width = pictures[i].width;
+        o_picture->codec->height = pictures[i].height;
+        /* Muxers refuse video streams without a time base. */
+        o_picture->time_base = (AVRational){1, 90000};
+        o_picture->codec->time_base = o_picture->time_base;
+        /* The muxers read the picture type and description from these. */
+        if (av_dict_copy(&o_picture->metadata, pictures[i].metadata, 0) < 0) {
+            err->message = "Unable to copy picture metadata.";
+            goto end;
+        }
+    }
+
+    /* Metadata */
+    AVDictionaryEntry *tag = NULL;
+    while((tag = av_dict_get(self->fmt_ctx->metadata, "",
+                             tag, AV_DICT_IGNORE_SUFFIX))) {
+        av_dict_set(&o_fmt_ctx->metadata, tag->key,
+                    tag->value, AV_DICT_IGNORE_SUFFIX);
+    }
+
+    if (avformat_write_header(o_fmt_ctx, NULL) < 0) {
+        err->message = "Unable to write metadata.";
+        goto end;
+    }
+
+    /* The picture streams directly follow the audio stream. */
+    int stream_index = o_stream->index + 1;
+    for (i = 0; i < nb_pictures; i++) {
+        if (!picture_supported(o_fmt, &pictures[i])) {
+            continue;
+        }
+        AVPacket picture;
+        av_init_packet(&picture);
+        picture.data = pictures[i].buf->data;
+        picture.size = pictures[i].buf->size;
+        picture.stream_index = stream_index++;
+        picture.flags |= AV_PKT_FLAG_KEY;
+        if (av_write_frame(o_fmt_ctx, &picture) < 0) {
+            err->message = "Unable to write picture.";
+            goto end;
+        }
+    }
+
+    while (hold_saves && !self->interrupted) {
+        usleep(1000);
+    }
+
+    /* A cancelled job may have left the stream anywhere. */
+    av_seek_frame(self->fmt_ctx, self->audio_stream->index, 0, 0);
+
+    AVPacket packet;
+    int write_result = 0;
+    while (write_result >= 0 && !self->interrupted &&
+           av_read_frame(self->fmt_ctx, &packet) >= 0) {
+        if (packet.stream_index == self->audio_stream->index) {
+            /* The output has its own stream order. */
+            packet.stream_index = o_stream->index;
+            write_result = av_write_frame(o_fmt_ctx, &packet);
+        }
+        av_free_packet(&packet);
+    }
+
+    av_seek_frame(self->fmt_ctx, self->audio_stream->index, 0, 0);
+
+    if (self->interrupted) {
+        err->message = "The operation was cancelled.";
+        goto end;
+    }
+    if (write_result < 0) {
+        err->message = "Unable to write audio.";
+        goto end;
+    }
+    if (av_write_trailer(o_fmt_ctx) < 0) {
+        err->message = "Error writing trailer info.";
+        goto end;
+    }
+    result = 0;
+
+end:
+    if (!(o_fmt->flags & AVFMT_NOFILE) && o_fmt_ctx->pb != NULL) {
+        avio_close(o_fmt_ctx->pb);
+    }
+    avformat_free_context(o_fmt_ctx);
+    if (result < 0) {
+        unlink(tmpfile);
+    } else if (rename(tmpfile, filename)) {
+        err->saved_errno = errno;
+        snprintf(err->path, sizeof(err->path), "%s", filename);
+        unlink(tmpfile);
+        result = -1;
+    }
+    return result;
+}
+
+/* Create a random tmp filename to store the unfinished file. */
+static char *
+make_tmpfile(void)
+{
+    static const char choice[] = "0123456789"
+                                 "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                 "abcdefghijklmnopqrstuvwxyz";
+    char *tmpfile = malloc(21);
+    if (tmpfile == NULL) {
+        return NULL;
+    }
+    unsigned int i = 1;
+    tmpfile[0] = '.';
+    for (; i < 20; i++) {
+        tmpfile[i] = choice[rand() % (sizeof(choice) - 1)];
+    }
+    tmpfile[i] = 0;
+    return tmpfile;
+}
+
+/* Set the Python attributes derived from the opened audio stream. */
+static int
+Song_load_stream_info(Song *self)
+{
+    self->codec_ctx = self->audio_stream->codec;
+    self->duration = PyFloat_FromDouble((double)self->fmt_ctx->duration /
+                                         AV_TIME_BASE);
+    self->sample_rate = PyLong_FromLong(self->codec_ctx->sample_rate);
+    self->channels = PyLong_FromLong(self->codec_ctx->channels);
+    if (!self->duration || !self->sample_rate || !self->channels) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Pool of AVFrames shared by all songs.
+ *
+ * Decoding takes a frame from the pool instead of allocating one for every
+ * block. Frames are returned unreferenced, so their data buffers go back to
+ * the buffer pool of the decoder. The pool is used by worker threads as well.
+ */
+#define FRAME_POOL_SIZE 16
+
+static struct {
+    pthread_mutex_t lock;
+    AVFrame *frames[FRAME_POOL_SIZE];
+    int nb_frames;
+} frame_pool = {PTHREAD_MUTEX_INITIALIZER, {NULL}, 0};
+
+static AVFrame *
+frame_pool_get(void)
+{
+    AVFrame *frame = NULL;
+    pthread_mutex_lock(&frame_pool.lock);
+    if (frame_pool.nb_frames > 0) {
+        frame = frame_pool.frames[--frame_pool.nb_frames];
+    }
+    pthread_mutex_unlock(&frame_pool.lock);
+    if (frame == NULL) {
+        frame = av_frame_alloc();
+    }
+    return frame;
+}
+
+static void
+frame_pool_put(AVFrame *frame)
+{
+    av_frame_unref(frame);
+    pthread_mutex_lock(&frame_pool.lock);
+    if (frame_pool.nb_frames < FRAME_POOL_SIZE) {
+        frame_pool.frames[frame_pool.nb_frames++] = frame;
+        frame = NULL;
+    }
+    pthread_mutex_unlock(&frame_pool.lock);
+    av_frame_free(&frame);
+}
+
+static void
+frame_pool_clear(void)
+{
+    pthread_mutex_lock(&frame_pool.lock);
+    while (frame_pool.nb_frames > 0) {
+        av_frame_free(&frame_pool.frames[--frame_pool.nb_frames]);
+    }
+    pthread_mutex_unlock(&frame_pool.lock);
+}
+
+static int
+Song_open_codec(Song *self)
+{
+    if (avcodec_is_open(self->codec_ctx)) {
+        return 0;
+    }
+    /* Let decoded frames reference pooled buffers instead of codec memory. */
+    self->codec_ctx->refcounted_frames = 1;
+    AVCodec *codec = avcodec_find_decoder(self->codec_ctx->codec_id);
+    if (codec == NULL) {
+        PyErr_SetString(PyExc_IOError, "Unable to find a decoder.");
+        return -1;
+    }
+    if (avcodec_open2(self->codec_ctx, codec, NULL) < 0) {
+        PyErr_SetString(PyExc_IOError, "Unable to open the decoder.");
+        return -1;
+    }
+    return 0;
+}
+
+/* Wrap the attached picture packets of the file without copying them. */
+static int
+Song_load_pictures(Song *self)
+{
+    if (self->pictures != NULL) {
+        return 0;
+    }
+    Song_CHECK_CLOSED(self, -1)
+    PyObject *pictures = PyList_New(0);
+    if (pictures == NULL) {
+        return -1;
+    }
+    unsigned int i = 0;
+    for (; i < self->fmt_ctx->nb_streams; i++) {
+        AVStream *stream = self->fmt_ctx->streams[i];
+        if (!(stream->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
+            continue;
+        }
+        AVPacket *packet = &stream->attached_pic;
+        AVBufferRef *buf;
+        if (packet->buf != NULL) {
+            /* Point the new reference at the packet data within the buffer */
+            buf = av_buffer_ref(packet->buf);
+            if (buf != NULL) {
+                buf->data = packet->data;
+            }
+        } else {
+            buf = av_buffer_alloc(packet->size + FF_INPUT_BUFFER_PADDING_SIZE);
+            if (buf != NULL) {
+                memcpy(buf->data, packet->data, packet->size);
+            }
+        }
+        if (buf == NULL) {
+            Py_DECREF(pictures);
+            PyErr_NoMemory();
+            return -1;
+        }
+        buf->size = packet->size;
+        /* The demuxer stores the picture type and description here. */
+        AVDictionary *metadata = NULL;
+        if (av_dict_copy(&metadata, stream->metadata, 0) < 0) {
+            av_buffer_unref(&buf);
+            av_dict_free(&metadata);
+            Py_DECREF(pictures);
+            PyErr_NoMemory();
+            return -1;
+        }
+        /* Not every demuxer reads the dimensions of attached pictures. */
+        int width = stream->codec->width;
+        int height = stream->codec->height;
+        if (width <= 0 || height <= 0) {
+            picture_dimensions(buf->data, buf->size, stream->codec->codec_id,
+                               &width, &height);
+        }
+        PyObject *picture = Picture_from_buffer(buf, stream->codec->codec_id,
+                                                width, height, metadata);
+        if (picture == NULL || PyList_Append(pictures, picture) < 0) {
+            Py_XDECREF(picture);
+            Py_DECREF(pictures);
+            return -1;
+        }
+        Py_DECREF(picture);
+    }
+    self->pictures = PyList_AsTuple(pictures);
+    Py_DECREF(pictures);
+    return self->pictures == NULL ? -1 : 0;
+}
+
+/* Reference the pictures to save, so they can be used without the GIL. */
+static int
+Song_collect_pictures(Song *self, PictureData **pictures, int *nb_pictures)
+{
+    if (Song_load_pictures(self) < 0) {
+        return -1;
+    }
+    int n = (int)PyTuple_GET_SIZE(self->pictures);
+    *pictures = calloc(n ? n : 1, sizeof(PictureData));
+    if (*pictures == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    int i = 0;
+    for (; i < n; i++) {
+        Picture *picture = (Picture *)PyTuple_GET_ITEM(self->pictures, i);
+        (*pictures)[i] = picture->data;
+        (*pictures)[i].buf = av_buffer_ref(picture->data.buf);
+        (*pictures)[i].metadata = NULL;
+        if ((*pictures)[i].buf == NULL ||
+                av_dict_copy(&(*pictures)[i].metadata,
+                             picture->data.metadata, 0) < 0) {
+            PictureData_free(*pictures, i + 1);
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    *nb_pictures = n;
+    return 0;
+}
+
+/**
+ * Definitions for the native worker pool.
+ *
+ * Jobs run on a bounded set of POSIX threads which never touch the Python
+ * interpreter. A finished job is handed back to the asyncio event loop by
+ * writing to a pipe the loop is watching. The loop then resolves the future of
+ * the job, so no Python thread is needed per call.
+ */
+typedef struct Job Job;
+
+struct Job {
+    Job *next;
+    /* Called on a worker thread without holding the GIL */
+    int (*run)(Job *job);
+    /* Called on the event loop to create the result of the future */
+    PyObject *(*finish)(Job *job);
+    volatile int cancelled;
+    int result;
+    SongError error;
+    /* Python */
+    PyObject *capsule;      /* Owns this job */
+    PyObject *future;
+    PyObject *owner;        /* Kept alive until the job is finished */
+    Song *song;             /* Marked busy until the job is finished */
+    /* Job specific data */
+    char *path;
+    char *tmpfile;
+    PictureData *pictures;
+    int nb_pictures;
+    uint8_t *data;
+    int size;
+};
+
+#define POOL_DEFAULT_WORKERS 4
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Job *queue_head;
+    Job *queue_tail;
+    Job *done;              /* Finished jobs, most recent first */
+    int max_workers;
+    int workers;
+    int idle;
+    int queued;             /* Jobs in the queue not claimed by a worker */
+    int shutdown;
+    /* Only accessed while holding the GIL */
+    int pending;            /* Jobs submitted but not yet finished */
+    int pipe_fds[2];
+    PyObject *loop;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    NULL,
+    NULL,
+    NULL,
+    POOL_DEFAULT_WORKERS,
+    0,
+    0,
+    0,
+    0,
+    0,
+    {-1, -1},
+    NULL
+};
+
+static void *
+pool_worker(void *unused)
+{
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.queue_head == NULL && !pool.shutdown &&
+               pool.workers <= pool.max_workers) {
+            pool.idle++;
+            pthread_cond_wait(&pool.cond, &pool.lock);
+            pool.idle--;
+        }
+        if (pool.shutdown || pool.workers > pool.max_workers) {
+            pool.workers--;
+            /* Let audiolayer_free know when the last worker is gone. */
+            pthread_cond_broadcast(&pool.cond);
+            break;
+        }
+        Job *job = pool.queue_head;
+        pool.queued--;
+        pool.queue_head = job->next;
+        if (pool.queue_head == NULL) {
+            pool.queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if (!job->cancelled) {
+            job->result = job->run(job);
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        int notify = pool.done == NULL;
+        job->next = pool.done;
+        pool.done = job;
+        /* The event loop drains all finished jobs, so one byte is enough. */
+        if (notify && write(pool.pipe_fds[1], "", 1) < 0) {
+            /* The pipe is full, so the loop will wake up anyway. */
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static int
+pool_start(void)
+{
+    if (pool.pipe_fds[0] != -1) {
+        return 0;
+    }
+    if (pipe(pool.pipe_fds) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    unsigned int i = 0;
+    for (; i < 2; i++) {
+        fcntl(pool.pipe_fds[i], F_SETFL, O_NONBLOCK);
+        fcntl(pool.pipe_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
+
+/* Resolve the future of a finished job and release it. */
+static void
+Job_finish(Job *job)
+{
+    if (job->song != NULL) {
+        song_release(job->song);
+        job->song = NULL;
+    }
+    PyObject *cancelled = PyObject_CallMethod(job->future, "cancelled", NULL);
+    if (cancelled == NULL) {
+        PyErr_WriteUnraisable(job->future);
+    } else if (!PyObject_IsTrue(cancelled)) {
+        PyObject *res;
+        PyObject *value = NULL;
+        if (job->result < 0) {
+            SongError_raise(&job->error);
+        } else {
+            value = job->finish(job);
+        }
+        if (value != NULL) {
+            res = PyObject_CallMethod(job->future, "set_result", "O", value);
+            Py_DECREF(value);
+        } else {
+            PyObject *type, *exc, *tb;
+            PyErr_Fetch(&type, &exc, &tb);
+            PyErr_NormalizeException(&type, &exc, &tb);
+            res = PyObject_CallMethod(job->future, "set_exception", "O", exc);
+            Py_XDECREF(type);
+            Py_XDECREF(exc);
+            Py_XDECREF(tb);
+        }
+        if (res == NULL) {
+            PyErr_WriteUnraisable(job->future);
+        }
+        Py_XDECREF(res);
+    }
+    Py_XDECREF(cancelled);
+    Py_CLEAR(job->future);
+    Py_CLEAR(job->owner);
+    /* This may free the job. */
+    Py_CLEAR(job->capsule);
+}
+
+/* Reader callback registered on the event loop for the pipe. */
+static PyObject *
+pool_dispatch(PyObject *unused, PyObject *noargs)
+{
+    char buf[64];
+    while (read(pool.pipe_fds[0], buf, sizeof(buf)) > 0) {
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    Job *done = pool.done;
+    pool.done = NULL;
+    pthread_mutex_unlock(&pool.lock);
+
+    /* Finish the jobs in the order they were completed. */
+    Job *job = NULL;
+    while (done != NULL) {
+        Job *next = done->next;
+        done->next = job;
+        job = done;
+        done = next;
+    }
+    while (job != NULL) {
+        Job *next = job->next;
+        Job_finish(job);
+        pool.pending--;
+        job = next;
+    }
+
+    if (pool.pending == 0 && pool.loop != NULL) {
+        PyObject *loop = pool.loop;
+        pool.loop = NULL;
+        PyObject *res = PyObject_CallMethod(loop, "remove_reader", "i",
+                                            pool.pipe_fds[0]);
+        Py_DECREF(loop);
+        if (res == NULL) {
+            return NULL;
+        }
+        Py_DECREF(res);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef pool_dispatch_def = {
+    "_dispatch", (PyCFunction)pool_dispatch, METH_NOARGS, NULL
+};
+
+static void
+Job_destroy(PyObject *capsule)
+{
+    Job *job = PyCapsule_GetPointer(capsule, "audiolayer.Job");
+    free(job->path);
+    free(job->tmpfile);
+    PictureData_free(job->pictures, job->nb_pictures);
+    av_free(job->data);
+    free(job);
+}
+
+/* Done callback of the future, used to propagate cancellation. */
+static PyObject *
+Job_cancel(PyObject *capsule, PyObject *future)
+{
+    Job *job = PyCapsule_GetPointer(capsule, "audiolayer.Job");
+    PyObject *cancelled = PyObject_CallMethod(future, "cancelled", NULL);
+    if (cancelled == NULL) {
+        return NULL;
+    }
+    if (PyObject_IsTrue(cancelled)) {
+        job->cancelled = 1;
+        if (job->song != NULL) {
+            job->song->interrupted = 1;
+        }
+    }
+    Py_DECREF(cancelled);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Job_cancel_def = {
+    "_cancel", (PyCFunction)Job_cancel, METH_O, NULL
+};
+
+static Job *
+Job_new(int (*run)(Job *), PyObject *(*finish)(Job *))
+{
+    Job *job = calloc(1, sizeof(Job));
+    if (job == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    job->run = run;
+    job->finish = finish;
+    job->result = -1;
+    job->error.message = "The operation was cancelled.";
+    job->capsule = PyCapsule_New(job, "audiolayer.Job", Job_destroy);
+    if (job->capsule == NULL) {
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+/**
+ * Queue a job on the worker pool and return an asyncio future for it.
+ *
+ * On failure the caller still owns the job and should release its capsule.
+ */
+static PyObject *
+pool_submit(Job *job, PyObject *owner, Song *song)
+{
+    PyObject *asyncio = PyImport_ImportModule("asyncio");
+    if (asyncio == NULL) {
+        return NULL;
+    }
+    PyObject *loop = PyObject_CallMethod(asyncio, "get_event_loop", NULL);
+    Py_DECREF(asyncio);
+    if (loop == NULL) {
+        return NULL;
+    }
+    PyObject *future = NULL;
+    PyObject *callback = NULL;
+    PyObject *res = NULL;
+
+    if (pool.loop != NULL && pool.loop != loop) {
+        res = PyObject_CallMethod(pool.loop, "is_closed", NULL);
+        if (res == NULL) {
+            goto error;
+        }
+        int closed = PyObject_IsTrue(res);
+        Py_CLEAR(res);
+        if (!closed) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "The worker pool is used by another event loop.");
+            goto error;
+        }
+        /* Jobs of a closed loop can no longer be resolved anyway. */
+        Py_CLEAR(pool.loop);
+    }
+    if (pool_start() < 0) {
+        goto error;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    /*
+     * Signalled workers stay idle until they wake up, so a burst of jobs needs
+     * new workers as soon as the idle ones are outnumbered.
+     */
+    if (pool.queued + 1 > pool.idle && pool.workers < pool.max_workers) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, NULL) == 0) {
+            pthread_detach(thread);
+            pool.workers++;
+        }
+    }
+    int workers = pool.workers;
+    pthread_mutex_unlock(&pool.lock);
+    if (workers == 0) {
+        PyErr_SetString(PyExc_OSError, "Unable to start a worker thread.");
+        goto error;
+    }
+
+    future = PyObject_CallMethod(loop, "create_future", NULL);
+    if (future == NULL) {
+        goto error;
+    }
+    callback = PyCFunction_New(&Job_cancel_def, job->capsule);
+    if (callback == NULL) {
+        goto error;
+    }
+    res = PyObject_CallMethod(future, "add_done_callback", "O", callback);
+    Py_CLEAR(callback);
+    if (res == NULL) {
+        goto error;
+    }
+    Py_CLEAR(res);
+
+    if (pool.loop == NULL) {
+        callback = PyCFunction_New(&pool_dispatch_def, NULL);
+        if (callback == NULL) {
+            goto error;
+        }
+        res = PyObject_CallMethod(loop, "add_reader", "iO",
+                                  pool.pipe_fds[0], callback);
+        Py_CLEAR(callback);
+        if (res == NULL) {
+            goto error;
+        }
+        Py_CLEAR(res);
+        Py_INCREF(loop);
+        pool.loop = loop;
+    }
+    Py_DECREF(loop);
+
+    Py_INCREF(future);
+    job->future = future;
+    Py_INCREF(owner);
+    job->owner = owner;
+    if (song != NULL) {
+        song->busy = 1;
+        job->song = song;
+    }
+    pool.pending++;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.queue_tail == NULL) {
+        pool.queue_head = job;
+    } else {
+        pool.queue_tail->next = job;
+    }
+    pool.queue_tail = job;
+    pool.queued++;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    return future;
+
+error:
+    Py_XDECREF(future);
+    Py_DECREF(loop);
+    return NULL;
+}
+
+/**
+ * Definitions for the BlockIterator class.
+ */
+typedef struct {
+    PyObject_HEAD
+    Song *song;
+    unsigned int generation; /* Generation of song this iterator reads */
+    AVPacket packet;        /* The packet which is being decoded */
+    AVPacket pending;       /* The part of packet which is not decoded yet */
+    int draining;           /* Set once the decoder is flushed at the end */
+    int exhausted;
+} BlockIterator;
+
+static void
+BlockIterator_dealloc(BlockIterator *self)
+{
+    av_free_packet(&self->packet);
+    Py_XDECREF(self->song);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Decode the next frame of the audio stream into job->data. */
+static int
+BlockIterator_decode(Job *job)
+{
+    BlockIterator *self = (BlockIterator *)job->owner;
+    Song *song = self->song;
+    AVCodecContext *codec_ctx = song->codec_ctx;
+    AVFrame *frame = frame_pool_get();
+    if (frame == NULL) {
+        job->error.message = "Unable to allocate frame.";
+        return -1;
+    }
+    int result = 0;
+    while (!song->interrupted) {
+        if (self->pending.size <= 0 && !self->draining) {
+            av_free_packet(&self->packet);
+            if (av_read_frame(song->fmt_ctx, &self->packet) < 0) {
+                /* Empty packets return the frames the decoder delays. */
+                self->draining = 1;
+                av_init_packet(&self->pending);
+                self->pending.data = NULL;
+                self->pending.size = 0;
+            } else {
+                self->pending = self->packet;
+                if (self->packet.stream_index != song->audio_stream->index) {
+                    self->pending.size = 0;
+                    continue;
+                }
+            }
+        }
+        int got_frame = 0;
+        int ret = avcodec_decode_audio4(codec_ctx, frame, &got_frame,
+                                        &self->pending);
+        if (self->draining) {
+            if (ret < 0 || !got_frame) {
+                av_seek_frame(song->fmt_ctx, song->audio_stream->index, 0, 0);
+                self->exhausted = 1;
+                break;
+            }
+        } else if (ret < 0) {
+            self->pending.size = 0;
+            continue;
+        } else {
+            self->pending.data += ret;
+            self->pending.size -= ret;
+            if (!got_frame) {
+                continue;
+            }
+        }
+
+        /* Planar samples are interleaved, so blocks can be played as is. */
+        int channels = codec_ctx->channels;
+        int sample_size = av_get_bytes_per_sample(codec_ctx->sample_fmt);
+        job->size = frame->nb_samples * channels * sample_size;
+        job->data = av_malloc(job->size);
+        if (job->data == NULL) {
+            job->error.message = "Unable to allocate audio block.";
+            result = -1;
+        } else if (av_sample_fmt_is_planar(codec_ctx->sample_fmt)) {
+            int s = 0;
+            for (; s < frame->nb_samples; s++) {
+                int c = 0;
+                for (; c < channels; c++) {
+                    memcpy(job->data + (s * channels + c) * sample_size,
+                           frame->extended_data[c] + s * sample_size,
+                           sample_size);
+                }
+            }
+        } else {
+            memcpy(job->data, frame->extended_data[0], job->size);
+        }
+        break;
+    }
+    if (song->interrupted) {
+        job->error.message = "The operation was cancelled.";
+        result = -1;
+    }
+    frame_pool_put(frame);
+    return result;
+}
+
+static PyObject *
+BlockIterator_finish(Job *job)
+{
+    if (job->data == NULL) {
+        PyErr_SetNone(PyExc_StopAsyncIteration);
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize((char *)job->data, job->size);
+}
+
+static PyObject *
+BlockIterator_aiter(PyObject *self)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject *
+BlockIterator_anext(BlockIterator *self)
+{
+    if (self->exhausted) {
+        PyErr_SetNone(PyExc_StopAsyncIteration);
+        return NULL;
+    }
+    Song_CHECK_CLOSED(self->song, NULL)
+    Song_CHECK_BUSY(self->song, NULL)
+    /* Another operation has moved the demuxer since the last block. */
+    if (self->generation != self->song->generation) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "The song was read by another operation.");
+        return NULL;
+    }
+    Job *job = Job_new(BlockIterator_decode, BlockIterator_finish);
+    if (job == NULL) {
+        return NULL;
+    }
+    PyObject *future = pool_submit(job, (PyObject *)self, self->song);
+    if (future == NULL) {
+        Py_DECREF(job->capsule);
+    }
+    return future;
+}
+
+static PyAsyncMethods BlockIterator_as_async = {
+    0,                              /* am_await */
+    BlockIterator_aiter,            /* am_aiter */
+    (unaryfunc)BlockIterator_anext, /* am_anext */
+};
+
+static PyTypeObject BlockIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "audiolayer.BlockIterator",             /* tp_name */
+    sizeof(BlockIterator),                  /* tp_basicsize */
+    0,                                      /* tp_itemsize */
+    (destructor)BlockIterator_dealloc,      /* tp_dealloc */
+    0,                                      /* tp_print */
+    0,                                      /* tp_getattr */
+    0,                                      /* tp_setattr */
+    &BlockIterator_as_async,                /* tp_as_async */
+    0,                                      /* tp_repr */
+    0,                                      /* tp_as_number */
+    0,                                      /* tp_as_sequence */
+    0,                                      /* tp_as_mapping */
+    0,                                      /* tp_hash  */
+    0,                                      /* tp_call */
+    0,                                      /* tp_str */
+    0,                                      /* tp_getattro */
+    0,                                      /* tp_setattro */
+    0,                                      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                     /* tp_flags */
+    "Asynchronous iterator over the decoded audio blocks of a song.",
+                                            /* tp_doc */
+};
+
+static int
+Song_init(Song *self, PyObject *args, PyObject *kwds)
+{
+    /* Song has already been initialized */
+    if (self->filepath != NULL) {
+        PyErr_SetString(PyExc_UserWarning,
+                        "This song object has already been initialized.");
+        return -1;
+    }
+    PyObject *obj;
+    PyObject *tmp;
+
+    if (!PyArg_ParseTuple(args, "U", &obj)) {
+        return -1;
+    }
+
+    char *str = PyUnicode_AsUTF8(obj);
+
+    if (obj) {
+        tmp = self->filepath;
+        Py_INCREF(obj);
+        self->filepath = obj;
+        Py_XDECREF(tmp);
+    }
+    SongError err = {0};
+    int result;
+    Py_BEGIN_ALLOW_THREADS
+    result = song_open(self, str, &err);
+    Py_END_ALLOW_THREADS
+    if (result < 0) {
+        SongError_raise(&err);
+        return -1;
+    }
+    return Song_load_stream_info(self);
 }
 
 /**
@@ -212,12 +1814,92 @@ Song_getchannels(Song *self, void *closure)
     return self->channels;
 }
 
+static PyObject *
+Song_getsampleformat(Song *self, void *closure)
+{
+    Song_CHECK_CLOSED(self, NULL)
+    /* Planar samples are interleaved when decoding blocks. */
+    const char *name = av_get_sample_fmt_name(
+        av_get_packed_sample_fmt(self->codec_ctx->sample_fmt));
+    if (name == NULL) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(name);
+}
+
+static PyObject *
+Song_getbytespersample(Song *self, void *closure)
+{
+    Song_CHECK_CLOSED(self, NULL)
+    return PyLong_FromLong(
+        av_get_bytes_per_sample(self->codec_ctx->sample_fmt));
+}
+
+static PyObject *
+Song_getbusy(Song *self, void *closure)
+{
+    return PyBool_FromLong(self->busy);
+}
+
+static PyObject *
+Song_getclosed(Song *self, void *closure)
+{
+    return PyBool_FromLong(self->fmt_ctx == NULL);
+}
+
+static PyObject *
+Song_getpictures(Song *self, void *closure)
+{
+    if (Song_load_pictures(self) < 0) {
+        return NULL;
+    }
+    Py_INCREF(self->pictures);
+    return self->pictures;
+}
+
+static int
+Song_setpictures(Song *self, PyObject *value, void *closure)
+{
+    Song_CHECK_BUSY(self, -1)
+    PyObject *pictures;
+    if (value == NULL) {
+        pictures = PyTuple_New(0);
+    } else {
+        PyObject *seq = PySequence_Fast(value,
+                                        "Pictures must be a sequence.");
+        if (seq == NULL) {
+            return -1;
+        }
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+        pictures = PyTuple_New(n);
+        Py_ssize_t i = 0;
+        for (; pictures != NULL && i < n; i++) {
+            PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+            PyObject *picture = Picture_from_object(item);
+            if (picture == NULL) {
+                Py_CLEAR(pictures);
+                break;
+            }
+            PyTuple_SET_ITEM(pictures, i, picture);
+        }
+        Py_DECREF(seq);
+    }
+    if (pictures == NULL) {
+        return -1;
+    }
+    PyObject *tmp = self->pictures;
+    self->pictures = pictures;
+    Py_XDECREF(tmp);
+    return 0;
+}
+
 /**
  * Subscript functions.
  */
 static PyObject *
 Song_getitem(Song *self, PyObject *key)
 {
+    Song_CHECK_CLOSED(self, NULL)
     char *str = PyUnicode_AsUTF8(key);
     AVDictionaryEntry *tag = NULL;
     while ((tag = av_dict_get(self->fmt_ctx->metadata,
@@ -233,19 +1915,27 @@ Song_getitem(Song *self, PyObject *key)
 static int
 Song_setitem(Song *self, PyObject *key, PyObject *value)
 {
+    Song_CHECK_CLOSED(self, -1)
+    Song_CHECK_BUSY(self, -1)
     if (!PyUnicode_Check(key)) {
         PyErr_SetString(PyExc_TypeError, "Key must be a string");
         return -1;
     }
     char *char_key = PyUnicode_AsUTF8(key);
     char *char_value = NULL;
+    PyObject *str_value = NULL;
     if (value != NULL) {
-        PyObject *str_value = PyObject_Str(value);
+        str_value = PyObject_Str(value);
+        if (str_value == NULL) {
+            return -1;
+        }
         char_value = PyUnicode_AsUTF8(str_value);
     }
-    return av_dict_set(&(self->fmt_ctx->metadata),
-                       char_key, char_value, AV_DICT_IGNORE_SUFFIX);
-    return 0;
+    /* The key and value are copied into the dictionary. */
+    int result = av_dict_set(&(self->fmt_ctx->metadata),
+                             char_key, char_value, AV_DICT_IGNORE_SUFFIX);
+    Py_XDECREF(str_value);
+    return result;
 }
 
 /**
@@ -254,6 +1944,7 @@ Song_setitem(Song *self, PyObject *key, PyObject *value)
 static PyObject *
 Song_print(Song *self)
 {
+    Song_CHECK_CLOSED(self, NULL)
     AVDictionaryEntry *tag = NULL;
     while ((tag = av_dict_get(self->fmt_ctx->metadata,
                               "", tag, AV_DICT_IGNORE_SUFFIX))) {
@@ -273,19 +1964,31 @@ Song_print(Song *self)
         return NULL; \
     }
 
-static PyObject *
-Song_play(Song *self)
+/* Stop and close the playback stream, keeping the first error. */
+static PaError
+Song_close_stream(Song *self, PaError err)
 {
-    AVCodec *codec = avcodec_find_decoder(self->audio_stream->codec->codec_id);
-    if (codec == NULL) {
-        return NULL;
+    if (self->pa_stream == NULL) {
+        return err;
     }
-    if (avcodec_find_decoder(self->codec_ctx->codec_id) < 0) {
-        return NULL;
+    PaError stop_err = Pa_StopStream(self->pa_stream);
+    PaError close_err = Pa_CloseStream(self->pa_stream);
+    self->pa_stream = NULL;
+    if (err == paNoError) {
+        err = stop_err != paNoError ? stop_err : close_err;
     }
-    if (avcodec_open2(self->codec_ctx, codec, NULL) < 0) {
+    return err;
+}
+
+static PyObject *
+Song_play(Song *self)
+{
+    Song_CHECK_CLOSED(self, NULL)
+    Song_CHECK_BUSY(self, NULL)
+    if (Song_open_codec(self) < 0) {
         return NULL;
     }
+    self->generation++;
 
     PaSampleFormat sample_fmt;
     switch (self->codec_ctx->sample_fmt) {
@@ -306,6 +2009,10 @@ Song_play(Song *self)
                             "Unable to parse audio sample format.");
             return NULL;
     }
+    AVFrame *frame = frame_pool_get();
+    if (frame == NULL) {
+        return PyErr_NoMemory();
+    }
     PaError err = Pa_OpenDefaultStream(&self->pa_stream,
                                        0,
                                        self->codec_ctx->channels,
@@ -314,32 +2021,30 @@ Song_play(Song *self)
                                        paFramesPerBufferUnspecified,
                                        NULL,
                                        NULL);
+    if (err != paNoError) {
+        self->pa_stream = NULL;
+        frame_pool_put(frame);
+    }
     PaPy_CHECK_ERROR(err)
     err = Pa_StartStream(self->pa_stream);
-    PaPy_CHECK_ERROR(err)
     AVPacket packet;
-    while (av_read_frame(self->fmt_ctx, &packet) >= 0) {
-        if (packet.stream_index != self->audio_stream->index) {
-            continue;
-        }
-        AVFrame frame;
-        int got_frame;
-        int ret = avcodec_decode_audio4(self->codec_ctx, &frame,
-                                        &got_frame, &packet);
-        if (ret < 0) {
-            continue;
-        }
-        if (ret != packet.size) {
-            continue;
-        }
-        if (got_frame) {
-            err = Pa_WriteStream(self->pa_stream, *frame.data,
-                                 frame.nb_samples);
-            PaPy_CHECK_ERROR(err)
+    while (err == paNoError && av_read_frame(self->fmt_ctx, &packet) >= 0) {
+        if (packet.stream_index == self->audio_stream->index) {
+            int got_frame = 0;
+            int ret = avcodec_decode_audio4(self->codec_ctx, frame,
+                                            &got_frame, &packet);
+            if (ret == packet.size && got_frame) {
+                err = Pa_WriteStream(self->pa_stream, *frame->data,
+                                     frame->nb_samples);
+            }
+            av_frame_unref(frame);
         }
         av_free_packet(&packet);
     }
     av_seek_frame(self->fmt_ctx, self->audio_stream->index, 0, 0);
+    frame_pool_put(frame);
+    err = Song_close_stream(self, err);
+    PaPy_CHECK_ERROR(err)
     Py_RETURN_NONE;
 }
 
@@ -354,126 +2059,148 @@ Song_save(Song *self, PyObject *args, PyObject *kwargs)
     if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|U", kwds, &py_filename)) {
         return NULL;
     }
-
-    /* Create a random tmp filename to store the unfinished file. */
-    static const char choice[] = "0123456789"
-                                 "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                                 "abcdefghijklmnopqrstuvwxyz";
-    char *tmpfile = malloc(21);
-    unsigned int i = 1;
-    tmpfile[0] = '.';
-    for (; i < 20; i++) {
-        tmpfile[i] = choice[rand() % (sizeof(choice) - 1)];
-    }
-    tmpfile[i] = 0;
+    Song_CHECK_CLOSED(self, NULL)
+    Song_CHECK_BUSY(self, NULL)
 
     if (py_filename) {
         filename = PyUnicode_AsUTF8(py_filename);
     } else {
         filename = self->fmt_ctx->filename;
     }
-    struct stat s;
-    char *dir = dirname(filename);
-    if(stat(dir, &s)) {
-        PyErr_SetFromErrnoWithFilename(PyExc_IOError, dir);
+    PictureData *pictures;
+    int nb_pictures;
+    if (Song_collect_pictures(self, &pictures, &nb_pictures) < 0) {
         return NULL;
     }
+    char *tmpfile = make_tmpfile();
+    if (tmpfile == NULL) {
+        PictureData_free(pictures, nb_pictures);
+        return PyErr_NoMemory();
+    }
 
-    AVOutputFormat *o_fmt = av_guess_format(self->fmt_ctx->iformat->name,
-                                            filename, NULL);
-    if (!o_fmt) {
-        PyErr_SetString(PyExc_IOError, "Unable to detect output format.");
+    SongError err = {0};
+    int result;
+    self->generation++;
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    result = song_write(self, filename, tmpfile, pictures, nb_pictures, &err);
+    Py_END_ALLOW_THREADS
+    song_release(self);
+    free(tmpfile);
+    PictureData_free(pictures, nb_pictures);
+    if (result < 0) {
+        SongError_raise(&err);
         return NULL;
     }
-    AVFormatContext *o_fmt_ctx = avformat_alloc_context();
-    o_fmt_ctx->oformat = o_fmt;
-    if (!o_fmt_ctx) {
-        PyErr_SetString(PyExc_IOError,
-                        "Unable to allocate output format context.");
+    Py_RETURN_NONE;
+}
+
+static int
+Song_save_run(Job *job)
+{
+    return song_write(job->song, job->path, job->tmpfile, job->pictures,
+                      job->nb_pictures, &job->error);
+}
+
+static PyObject *
+Song_save_finish(Job *job)
+{
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Song_save_async(Song *self, PyObject *args, PyObject *kwargs)
+{
+    char *filename;
+    PyObject *py_filename = NULL;
+
+    static char *kwds[] = {"filename", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|U", kwds, &py_filename)) {
         return NULL;
     }
-    if (!(o_fmt->flags & AVFMT_NOFILE)) {
-        if (avio_open(&(o_fmt_ctx->pb), tmpfile, AVIO_FLAG_WRITE) < 0) {
-            PyErr_SetString(PyExc_IOError,
-                            "Unable to open temporary output file.");
-            return NULL;
-        }
+    Song_CHECK_CLOSED(self, NULL)
+    Song_CHECK_BUSY(self, NULL)
+
+    if (py_filename) {
+        filename = PyUnicode_AsUTF8(py_filename);
+    } else {
+        filename = self->fmt_ctx->filename;
     }
-    AVStream *o_stream = avformat_new_stream(o_fmt_ctx, NULL);
-    if (!o_stream) {
-        PyErr_SetString(PyExc_IOError, "Unable to allocate output stream.");
+    Job *job = Job_new(Song_save_run, Song_save_finish);
+    if (job == NULL) {
         return NULL;
     }
-    AVStream *i_stream = self->audio_stream;
-    o_stream->id = i_stream->id;
-    o_stream->disposition = i_stream->disposition;
-    o_stream->codec->bits_per_raw_sample =
-        i_stream->codec->bits_per_raw_sample;
-    o_stream->codec->chroma_sample_location =
-        i_stream->codec->chroma_sample_location;
-    o_stream->codec->codec_id = i_stream->codec->codec_id;
-    o_stream->codec->codec_type = i_stream->codec->codec_type;
-    o_stream->codec->codec_tag = i_stream->codec->codec_tag;
-    o_stream->codec->bit_rate = i_stream->codec->bit_rate;
-    o_stream->codec->rc_max_rate = i_stream->codec->rc_max_rate;
-    o_stream->codec->rc_buffer_size = i_stream->codec->rc_buffer_size;
-    o_stream->codec->field_order = i_stream->codec->field_order;
-    uint64_t extra_size = (uint64_t)i_stream->codec->extradata_size +
-        FF_INPUT_BUFFER_PADDING_SIZE;
-    if (extra_size > INT_MAX) {
-        return NULL;
+    job->path = strdup(filename);
+    job->tmpfile = make_tmpfile();
+    if (job->path == NULL || job->tmpfile == NULL) {
+        Py_DECREF(job->capsule);
+        return PyErr_NoMemory();
     }
-    o_stream->codec->extradata = av_mallocz(extra_size);
-    if (!o_stream->codec->extradata) {
+    if (Song_collect_pictures(self, &job->pictures, &job->nb_pictures) < 0) {
+        Py_DECREF(job->capsule);
         return NULL;
     }
-    memcpy(o_stream->codec->extradata, i_stream->codec->extradata,
-           i_stream->codec->extradata_size);
-    o_stream->codec->extradata_size = i_stream->codec->extradata_size;
-    o_stream->codec->time_base = i_stream->time_base;
-
-    /* Audio specific */
-    o_stream->codec->channel_layout = i_stream->codec->channel_layout;
-    o_stream->codec->sample_rate = i_stream->codec->sample_rate;
-    o_stream->codec->channels = i_stream->codec->channels;
-    o_stream->codec->frame_size = i_stream->codec->frame_size;
-    o_stream->codec->audio_service_type = i_stream->codec->audio_service_type;
-    o_stream->codec->block_align = i_stream->codec->block_align;
-
-    /* Metadata */
-    AVDictionaryEntry *tag = NULL;
-    while((tag = av_dict_get(self->fmt_ctx->metadata, "",
-                             tag, AV_DICT_IGNORE_SUFFIX))) {
-        av_dict_set(&o_fmt_ctx->metadata, tag->key,
-                    tag->value, AV_DICT_IGNORE_SUFFIX);
+    PyObject *future = pool_submit(job, (PyObject *)self, self);
+    if (future == NULL) {
+        Py_DECREF(job->capsule);
+        return NULL;
     }
+    self->generation++;
+    return future;
+}
 
-    if (avformat_write_header(o_fmt_ctx, NULL) < 0) {
-        PyErr_SetString(PyExc_IOError, "Unable to write metadata.");
+static PyObject *
+Song_blocks(Song *self)
+{
+    Song_CHECK_CLOSED(self, NULL)
+    Song_CHECK_BUSY(self, NULL)
+    if (Song_open_codec(self) < 0) {
         return NULL;
     }
-
-    AVPacket packet;
-    while (av_read_frame(self->fmt_ctx, &packet) >= 0) {
-        if (packet.stream_index != self->audio_stream->index) {
-            continue;
-        }
-        av_write_frame(o_fmt_ctx, &packet);
-        av_free_packet(&packet);
+    BlockIterator *blocks =
+        (BlockIterator *)BlockIteratorType.tp_alloc(&BlockIteratorType, 0);
+    if (blocks == NULL) {
+        return NULL;
     }
-
+    av_init_packet(&blocks->packet);
+    blocks->packet.data = NULL;
+    blocks->packet.size = 0;
+    blocks->pending = blocks->packet;
+    /* A cancelled job may have left the stream anywhere. */
     av_seek_frame(self->fmt_ctx, self->audio_stream->index, 0, 0);
+    avcodec_flush_buffers(self->codec_ctx);
+    blocks->generation = ++self->generation;
+    Py_INCREF(self);
+    blocks->song = self;
+    return (PyObject *)blocks;
+}
 
-    if (av_write_trailer(o_fmt_ctx) < 0) {
-        PyErr_SetString(PyExc_IOError, "Error writing trailer info.");
-        return NULL;
-    }
+static PyObject *
+Song_close(Song *self)
+{
+    Song_CHECK_BUSY(self, NULL)
+    song_close(self);
+    Py_RETURN_NONE;
+}
 
-    avio_close(o_fmt_ctx->pb);
-    avformat_free_context(o_fmt_ctx);
-    rename(tmpfile, filename);
+static PyObject *
+Song_enter(Song *self)
+{
+    Song_CHECK_CLOSED(self, NULL)
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
 
-    Py_RETURN_NONE;
+static PyObject *
+Song_exit(Song *self, PyObject *args)
+{
+    /* Raising here would replace the exception leaving the with block. */
+    if (self->busy) {
+        self->close_pending = 1;
+        Py_RETURN_NONE;
+    }
+    return Song_close(self);
 }
 
 /**
@@ -490,6 +2217,7 @@ static PyObject *
 Song_iternext(PyObject *self_as_obj)
 {
     Song *self = (Song *)self_as_obj;
+    Song_CHECK_CLOSED(self, NULL)
     self->current_tag = av_dict_get(self->fmt_ctx->metadata, "",
                                     self->current_tag, AV_DICT_IGNORE_SUFFIX);
     if (self->current_tag == NULL) {
@@ -507,6 +2235,7 @@ Song_iternext(PyObject *self_as_obj)
 static Py_ssize_t
 Song_len(Song *self)
 {
+    Song_CHECK_CLOSED(self, -1)
     unsigned int len = 0;
     AVDictionaryEntry *tag = NULL;
     while ((tag = av_dict_get(self->fmt_ctx->metadata,
@@ -520,6 +2249,7 @@ static int
 Song_contains(PyObject *self_as_obj, PyObject *key)
 {
     Song *self = (Song *)self_as_obj;
+    Song_CHECK_CLOSED(self, -1)
 
     char *str = PyUnicode_AsUTF8(key);
     AVDictionaryEntry *tag = NULL;
@@ -535,6 +2265,9 @@ Song_contains(PyObject *self_as_obj, PyObject *key)
 static PyObject *
 Song_str(Song *self)
 {
+    if (self->fmt_ctx == NULL) {
+        return PyUnicode_FromString("audiolayer.Song(closed)");
+    }
     char *ret = "audiolayer.Song(";
     AVDictionaryEntry *tag = NULL;
     AVDictionaryEntry *next = av_dict_get(self->fmt_ctx->metadata, "", NULL,
@@ -557,19 +2290,40 @@ Song_str(Song *self)
         char *tmp = malloc(strlen(ret) + strlen(key) + strlen(next->value) +
                            strlen(prefix) + strlen(value_start) +
                            strlen(value_end) + 1);
+        if (tmp == NULL) {
+            break;
+        }
         strcpy(tmp, ret);
         strcat(tmp, prefix);
         strcat(tmp, key);
         strcat(tmp, value_start);
         strcat(tmp, next->value);
         strcat(tmp, value_end);
+        /* Only the initial string is not allocated. */
+        if (tag != NULL) {
+            free(ret);
+        }
         ret = tmp;
         tag = next;
     }
-    char *tmp = malloc(strlen(ret) + 2);
-    strcpy(tmp, ret);
-    strcat(tmp, ")");
-    return PyUnicode_FromString(tmp);
+    char *tmp = NULL;
+    /* next is only set if the loop was aborted because malloc failed. */
+    if (next == NULL) {
+        tmp = malloc(strlen(ret) + 2);
+    }
+    if (tmp != NULL) {
+        strcpy(tmp, ret);
+        strcat(tmp, ")");
+    }
+    if (tag != NULL) {
+        free(ret);
+    }
+    if (tmp == NULL) {
+        return PyErr_NoMemory();
+    }
+    PyObject *str = PyUnicode_FromString(tmp);
+    free(tmp);
+    return str;
 }
 
 /**
@@ -601,6 +2355,14 @@ static PyGetSetDef Song_getseters[] = {
     {"sample_rate", (getter)Song_getsamplerate, NULL,
      Song_samplerate__doc__, NULL},
     {"channels", (getter)Song_getchannels, NULL, Song_channels__doc__, NULL},
+    {"pictures", (getter)Song_getpictures, (setter)Song_setpictures,
+     Song_pictures__doc__, NULL},
+    {"closed", (getter)Song_getclosed, NULL, Song_closed__doc__, NULL},
+    {"busy", (getter)Song_getbusy, NULL, Song_busy__doc__, NULL},
+    {"sample_format", (getter)Song_getsampleformat, NULL,
+     Song_sampleformat__doc__, NULL},
+    {"bytes_per_sample", (getter)Song_getbytespersample, NULL,
+     Song_bytespersample__doc__, NULL},
     {NULL}
 };
 
@@ -608,7 +2370,13 @@ static PyMethodDef Song_methods[] = {
     {"print", (PyCFunction)Song_print, METH_NOARGS, Song_print__doc__},
     {"save", (PyCFunction)Song_save, METH_VARARGS | METH_KEYWORDS,
      Song_save__doc__},
+    {"save_async", (PyCFunction)Song_save_async, METH_VARARGS | METH_KEYWORDS,
+     Song_save_async__doc__},
+    {"blocks", (PyCFunction)Song_blocks, METH_NOARGS, Song_blocks__doc__},
     {"play", (PyCFunction)Song_play, METH_NOARGS, Song_play__doc__},
+    {"close", (PyCFunction)Song_close, METH_NOARGS, Song_close__doc__},
+    {"__enter__", (PyCFunction)Song_enter, METH_NOARGS, Song_enter__doc__},
+    {"__exit__", (PyCFunction)Song_exit, METH_VARARGS, Song_exit__doc__},
     {NULL}
 };
 
@@ -658,10 +2426,150 @@ static PyTypeObject SongType = {
  * Definitions for the audiolayer module.
  */
 PyDoc_STRVAR(audiolayer__doc__, "This module contains the Song object.");
+PyDoc_STRVAR(audiolayer_open__doc__, "Open a song without blocking.\n\
+\n\
+The file is opened on the native worker pool. An asyncio future is returned \
+which resolves to a Song.\n\
+\n\
+>>> song = await audiolayer.open('test.flac')\n\
+>>> song['artist']\n\
+Machinae Supremacy\n\
+>>>\n\
+\n\
+:param filepath: The path of the file to open.");
+PyDoc_STRVAR(audiolayer_set_max_workers__doc__,
+             "Set the maximum number of native worker threads.\n\
+\n\
+This bounds the number of files which are opened, saved or decoded \
+concurrently. Other jobs wait in a queue. The default is 4.\n\
+\n\
+:param workers: The maximum number of worker threads.");
+
+static int
+audiolayer_open_run(Job *job)
+{
+    return song_open(job->song, job->path, &job->error);
+}
+
+static PyObject *
+audiolayer_open_finish(Job *job)
+{
+    Song *song = (Song *)job->owner;
+    if (Song_load_stream_info(song) < 0) {
+        return NULL;
+    }
+    Py_INCREF(song);
+    return (PyObject *)song;
+}
+
+static PyObject *
+audiolayer_open(PyObject *module, PyObject *args)
+{
+    PyObject *obj;
+
+    if (!PyArg_ParseTuple(args, "U", &obj)) {
+        return NULL;
+    }
+    char *str = PyUnicode_AsUTF8(obj);
+    if (str == NULL) {
+        return NULL;
+    }
+    Song *song = (Song *)SongType.tp_alloc(&SongType, 0);
+    if (song == NULL) {
+        return NULL;
+    }
+    song->fd = -1;
+    Py_INCREF(obj);
+    song->filepath = obj;
+
+    PyObject *future = NULL;
+    Job *job = Job_new(audiolayer_open_run, audiolayer_open_finish);
+    if (job != NULL) {
+        job->path = strdup(str);
+        if (job->path == NULL) {
+            PyErr_NoMemory();
+        } else {
+            future = pool_submit(job, (PyObject *)song, song);
+        }
+        if (future == NULL) {
+            Py_DECREF(job->capsule);
+        }
+    }
+    Py_DECREF(song);
+    return future;
+}
+
+static PyObject *
+audiolayer_set_max_workers(PyObject *module, PyObject *args)
+{
+    int workers;
+
+    if (!PyArg_ParseTuple(args, "i", &workers)) {
+        return NULL;
+    }
+    if (workers < 1) {
+        PyErr_SetString(PyExc_ValueError, "At least 1 worker is required.");
+        return NULL;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.max_workers = workers;
+    /* Wake up idle workers, so surplus workers can exit. */
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    Py_RETURN_NONE;
+}
+
+/* Only meant for the tests, so it is not documented. */
+static PyObject *
+audiolayer_hold_saves(PyObject *module, PyObject *args)
+{
+    int hold;
+
+    if (!PyArg_ParseTuple(args, "p", &hold)) {
+        return NULL;
+    }
+    hold_saves = hold;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef audiolayer_methods[] = {
+    {"open", (PyCFunction)audiolayer_open, METH_VARARGS,
+     audiolayer_open__doc__},
+    {"set_max_workers", (PyCFunction)audiolayer_set_max_workers, METH_VARARGS,
+     audiolayer_set_max_workers__doc__},
+    {"_hold_saves", (PyCFunction)audiolayer_hold_saves, METH_VARARGS, NULL},
+    {NULL}
+};
 
 static void
 audiolayer_free(void *unused)
 {
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.cond);
+    /* Running jobs still write to the pipe when they finish. */
+    while (pool.workers > 0) {
+        pthread_cond_wait(&pool.cond, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if (pool.loop != NULL) {
+        PyObject *res = PyObject_CallMethod(pool.loop, "remove_reader", "i",
+                                            pool.pipe_fds[0]);
+        if (res == NULL) {
+            PyErr_Clear();
+        }
+        Py_XDECREF(res);
+        Py_CLEAR(pool.loop);
+    }
+    unsigned int i = 0;
+    for (; i < 2; i++) {
+        if (pool.pipe_fds[i] != -1) {
+            close(pool.pipe_fds[i]);
+            pool.pipe_fds[i] = -1;
+        }
+    }
+    frame_pool_clear();
+    io_pool_clear();
     Pa_Terminate();
 }
 
@@ -670,7 +2578,7 @@ static PyModuleDef audiolayermodule = {
     "audiolayer",               /* m_name */
     audiolayer__doc__,          /* m_doc */
     -1,                         /* m_size */
-    NULL,                       /* m_methods */
+    audiolayer_methods,         /* m_methods */
     NULL,                       /* m_reload */
     NULL,                       /* m_traverse */
     NULL,                       /* m_clear */
@@ -698,6 +2606,12 @@ PyInit_audiolayer(void)
     if (PyType_Ready(&SongType) < 0) {
         return NULL;
     }
+    if (PyType_Ready(&BlockIteratorType) < 0) {
+        return NULL;
+    }
+    if (PyType_Ready(&PictureType) < 0) {
+        return NULL;
+    }
 
     module = PyModule_Create(&audiolayermodule);
     if (module == NULL) {
@@ -710,5 +2624,10 @@ PyInit_audiolayer(void)
     PyModule_AddObject(module, "NoMediaException", NoMediaException);
     Py_INCREF(&SongType);
     PyModule_AddObject(module, "Song", (PyObject *)&SongType);
+    Py_INCREF(&BlockIteratorType);
+    PyModule_AddObject(module, "BlockIterator",
+                       (PyObject *)&BlockIteratorType);
+    Py_INCREF(&PictureType);
+    PyModule_AddObject(module, "Picture", (PyObject *)&PictureType);
     return module;
 }
@@ -1,9 +1,15 @@
+import asyncio
 import functools
 import os
 import shutil
+import struct
+import sys
 import unittest
+import zlib
 
+import audiolayer
 from audiolayer import NoMediaException
+from audiolayer import Picture
 from audiolayer import Song
 
 
@@ -14,6 +20,33 @@ testfile = os.path.join(os.path.dirname(__import__(__name__).__file__),
                         'test.flac')
 
 
+def png(width=1, height=1):
+    """
+    Create a valid black PNG image of the given size.
+
+    """
+    def chunk(kind, data):
+        crc = zlib.crc32(kind + data) & 0xffffffff
+        return struct.pack('>I', len(data)) + kind + data + \
+            struct.pack('>I', crc)
+    header = struct.pack('>IIBBBBB', width, height, 8, 0, 0, 0, 0)
+    pixels = zlib.compress((b'\0' * (width + 1)) * height)
+    return b'\x89PNG\r\n\x1a\n' + chunk(b'IHDR', header) + \
+        chunk(b'IDAT', pixels) + chunk(b'IEND', b'')
+
+
+def mp3(frames):
+    """
+    Create a silent mono MP3 of the given number of frames. Each frame
+    holds 1152 samples.
+
+    """
+    # MPEG-1 layer III, 128 kbit/s, 44100 Hz, mono. Empty side info and
+    # main data decode to silence.
+    header = b'\xff\xfb\x90\xc4'
+    return (header + b'\0' * (417 - len(header))) * frames
+
+
 def cleanup(filename):
     """
     This function should be used as a decorator. The filename is
@@ -330,6 +363,278 @@ class TestSongAudioInfo(unittest.TestCase):
         self.assertIs(song.channels, song.channels)
 
 
+class TestSongPictures(unittest.TestCase):
+    """
+    Test reading, replacing and saving attached pictures.
+
+    """
+    def test_pictures(self):
+        """
+        Test the pictures are a tuple which is only created once.
+
+        """
+        song = Song(testfile)
+        self.assertIsInstance(song.pictures, tuple)
+        self.assertIs(song.pictures, song.pictures)
+        for picture in song.pictures:
+            self.assertIsInstance(picture, Picture)
+
+    def test_set_pictures(self):
+        """
+        Test replacing the pictures with bytes-like objects.
+
+        """
+        song = Song(testfile)
+        image = png()
+        song.pictures = [image, bytearray(image)]
+        self.assertEqual(len(song.pictures), 2)
+        for picture in song.pictures:
+            self.assertEqual(picture.mime_type, 'image/png')
+            self.assertEqual(bytes(picture), image)
+
+    def test_type(self):
+        """
+        Test new pictures are front covers and their type and
+        description can be changed.
+
+        """
+        song = Song(testfile)
+        song.pictures = [png()]
+        picture = song.pictures[0]
+        self.assertEqual(picture.type, 'Cover (front)')
+        self.assertIsNone(picture.description)
+        picture.type = 'Cover (back)'
+        picture.description = 'Back'
+        self.assertEqual(picture.type, 'Cover (back)')
+        self.assertEqual(picture.description, 'Back')
+        picture.description = None
+        self.assertIsNone(picture.description)
+        with self.assertRaises(TypeError):
+            picture.type = 5
+
+    def test_buffer(self):
+        """
+        Test a picture exposes its data as a read-only buffer.
+
+        """
+        song = Song(testfile)
+        song.pictures = [png()]
+        view = memoryview(song.pictures[0])
+        self.assertTrue(view.readonly)
+        self.assertEqual(view.tobytes(), png())
+
+    def test_invalid_picture(self):
+        """
+        Test only supported image formats can be attached.
+
+        """
+        song = Song(testfile)
+        with self.assertRaises(ValueError):
+            song.pictures = [b'not an image']
+        # The dimensions are required to write the picture.
+        with self.assertRaises(ValueError):
+            song.pictures = [png()[:16]]
+        with self.assertRaises(TypeError):
+            song.pictures = 5
+
+    def test_delete(self):
+        """
+        Test deleting the pictures removes all of them.
+
+        """
+        song = Song(testfile)
+        song.pictures = [png()]
+        del song.pictures
+        self.assertEqual(song.pictures, ())
+
+    @cleanup('out_pictures.flac')
+    def test_save(self, filename):
+        """
+        Test the pictures, including their type and description, are
+        preserved when saving a file which already has pictures.
+
+        """
+        song = Song(testfile)
+        song.pictures = [png(), png(2, 2)]
+        song.pictures[1].type = 'Cover (back)'
+        song.pictures[1].description = 'Back'
+        song.save(filename=filename)
+        # Save the reopened file, so the pictures are read from the file.
+        song = Song(filename)
+        song['artist'] = 'MaSu'
+        song.save()
+        copy = Song(filename)
+        self.assertEqual(copy['artist'], 'MaSu')
+        self.assertEqual([bytes(p) for p in copy.pictures],
+                         [png(), png(2, 2)])
+        self.assertEqual([p.type for p in copy.pictures],
+                         ['Cover (front)', 'Cover (back)'])
+        self.assertEqual(copy.pictures[1].description, 'Back')
+
+    @cleanup('out_new_pictures.flac')
+    def test_save_replaced(self, filename):
+        """
+        Test replaced pictures are written when saving.
+
+        """
+        song = Song(testfile)
+        song.pictures = [png(2, 2)]
+        song.save(filename=filename)
+        copy = Song(filename)
+        self.assertEqual(len(copy.pictures), 1)
+        self.assertEqual(copy.pictures[0].mime_type, 'image/png')
+        self.assertEqual(copy.pictures[0].type, 'Cover (front)')
+        self.assertEqual(bytes(copy.pictures[0]), png(2, 2))
+
+
+class TestSongLifecycle(unittest.TestCase):
+    """
+    Test closing a Song releases its file.
+
+    """
+    def test_close(self):
+        """
+        Test closing a song and closing it again.
+
+        """
+        song = Song(testfile)
+        self.assertFalse(song.closed)
+        song.close()
+        self.assertTrue(song.closed)
+        song.close()
+        self.assertTrue(song.closed)
+
+    def test_closed_operations(self):
+        """
+        Test using the file of a closed song raises a ValueError, while
+        the loaded stream info is still available.
+
+        """
+        song = Song(testfile)
+        song.close()
+        with self.assertRaises(ValueError):
+            song['artist']
+        with self.assertRaises(ValueError):
+            song['artist'] = 'MaSu'
+        with self.assertRaises(ValueError):
+            len(song)
+        with self.assertRaises(ValueError):
+            'artist' in song
+        with self.assertRaises(ValueError):
+            song.save(filename='out_closed.flac')
+        with self.assertRaises(ValueError):
+            song.pictures
+        self.assertEqual(song.sample_rate, 44100)
+        self.assertEqual(str(song), 'audiolayer.Song(closed)')
+
+    def test_context_manager(self):
+        """
+        Test a song is closed when leaving a with statement.
+
+        """
+        with Song(testfile) as song:
+            self.assertEqual(song['artist'], 'Machinae Supremacy')
+        self.assertTrue(song.closed)
+        with self.assertRaises(ValueError):
+            with song:
+                pass
+
+    def test_close_busy(self):
+        """
+        Test a song can not be closed while it is being saved.
+
+        """
+        song = Song(testfile)
+        loop = asyncio.new_event_loop()
+        self.addCleanup(loop.close)
+
+        async def run():
+            future = song.save_async(filename='out_close_busy.flac')
+            with self.assertRaises(RuntimeError):
+                song.close()
+            await future
+        try:
+            loop.run_until_complete(run())
+        finally:
+            if os.path.isfile('out_close_busy.flac'):
+                os.remove('out_close_busy.flac')
+        song.close()
+        self.assertTrue(song.closed)
+
+
+@unittest.skipUnless(os.path.isdir('/proc/self/fd'),
+                     'FD and RSS counts are read from /proc.')
+class TestSoak(unittest.TestCase):
+    """
+    Test memory and file descriptor usage stay flat over many open, edit,
+    decode and close cycles. The number of cycles can be set using the
+    AUDIOLAYER_SOAK_CYCLES environment variable.
+
+    """
+    cycles = int(os.environ.get('AUDIOLAYER_SOAK_CYCLES', 2000))
+    samples = 8
+    # Allowed resident set size growth in KiB per cycle.
+    growth = 0.25
+
+    def setUp(self):
+        self.loop = asyncio.new_event_loop()
+        asyncio.set_event_loop(self.loop)
+
+    def tearDown(self):
+        self.loop.close()
+        asyncio.set_event_loop(None)
+
+    @staticmethod
+    def fd_count():
+        return len(os.listdir('/proc/self/fd'))
+
+    @staticmethod
+    def rss():
+        """
+        The resident set size in KiB.
+
+        """
+        with open('/proc/self/statm') as f:
+            pages = int(f.read().split()[1])
+        return pages * os.sysconf('SC_PAGE_SIZE') // 1024
+
+    def cycle(self):
+        with Song(testfile) as song:
+            song['artist']
+            song['comment'] = 'Soak test'
+            str(song)
+            song.pictures
+            block = self.loop.run_until_complete(song.blocks().__anext__())
+            self.assertTrue(block)
+
+    def test_open_close(self):
+        """
+        Test opening, editing, decoding and closing songs does not leak.
+
+        """
+        # Warm up allocator arenas and the frame pool.
+        for _ in range(100):
+            self.cycle()
+        fds = self.fd_count()
+        rss = [self.rss()]
+        per_sample = max(self.cycles // self.samples, 1)
+        for _ in range(self.samples):
+            for _ in range(per_sample):
+                self.cycle()
+            rss.append(self.rss())
+        new_fds = self.fd_count()
+        cycles = per_sample * self.samples
+        report = 'soak: {} cycles, fds {} -> {}, rss {} KiB'.format(
+            cycles, fds, new_fds, ' -> '.join(map(str, rss)))
+        sys.stderr.write(report + '\n')
+        self.assertEqual(new_fds, fds, report)
+        self.assertLess(rss[-1] - rss[0], cycles * self.growth, report)
+        # Growth within a page between samples is noise, not a trend.
+        page = os.sysconf('SC_PAGE_SIZE') // 1024
+        self.assertFalse(all(b - a > page for a, b in zip(rss, rss[1:])),
+                         'Memory grows steadily. ' + report)
+
+
 class TestSongPlayback(unittest.TestCase):
     """
     Test the playback is handled correctly and the play method does not
@@ -343,5 +648,298 @@ class TestSongPlayback(unittest.TestCase):
         self.assertIsNone(song.play())
 
 
+class AsyncTestCase(unittest.TestCase):
+    """
+    Base class for tests which need to run coroutines on an event loop.
+
+    """
+    def setUp(self):
+        self.loop = asyncio.new_event_loop()
+        asyncio.set_event_loop(self.loop)
+
+    def tearDown(self):
+        self.loop.close()
+        asyncio.set_event_loop(None)
+
+    def run_async(self, coro):
+        return self.loop.run_until_complete(coro)
+
+    async def wait_idle(self, song, timeout=10):
+        """
+        Wait until no job uses the song anymore.
+
+        """
+        deadline = self.loop.time() + timeout
+        while song.busy:
+            self.assertLess(self.loop.time(), deadline, 'Song stays busy.')
+            await asyncio.sleep(0.001)
+
+    async def decode(self, song):
+        """
+        Decode all audio of the song.
+
+        """
+        data = b''
+        async for block in song.blocks():
+            data += block
+        return data
+
+
+class TestAsyncOpen(AsyncTestCase):
+    """
+    Test opening songs on the native worker pool.
+
+    """
+    def test_open(self):
+        """
+        Test awaiting audiolayer.open resolves to an initialized Song.
+
+        """
+        async def run():
+            return await audiolayer.open(testfile)
+        song = self.run_async(run())
+        self.assertIsInstance(song, Song)
+        self.assertEqual(song.filepath, testfile)
+        self.assertEqual(song['artist'], 'Machinae Supremacy')
+        self.assertEqual(song.sample_rate, 44100)
+
+    def test_non_existing_file(self):
+        """
+        Test the same exceptions are raised as when initializing a Song.
+
+        """
+        errfile = 'f' * 200
+
+        async def run():
+            return await audiolayer.open(errfile)
+        with self.assertRaises(FileNotFoundError) as ctx:
+            self.run_async(run())
+        self.assertEqual(ctx.exception.filename, errfile)
+
+    def test_concurrent(self):
+        """
+        Test many songs can be opened concurrently with a bounded pool.
+
+        """
+        audiolayer.set_max_workers(2)
+        self.addCleanup(audiolayer.set_max_workers, 4)
+
+        async def run():
+            return await asyncio.gather(
+                *[audiolayer.open(testfile) for _ in range(20)])
+        songs = self.run_async(run())
+        self.assertEqual(len(songs), 20)
+        for song in songs:
+            self.assertEqual(song['title'], 'Megascorcher')
+
+    def test_invalid_max_workers(self):
+        """
+        Test the worker pool needs at least one worker.
+
+        """
+        with self.assertRaises(ValueError):
+            audiolayer.set_max_workers(0)
+
+    def test_cancel(self):
+        """
+        Test cancelling an open call does not break the worker pool.
+
+        """
+        async def run():
+            future = audiolayer.open(testfile)
+            future.cancel()
+            with self.assertRaises(asyncio.CancelledError):
+                await future
+            return await audiolayer.open(testfile)
+        self.assertIsInstance(self.run_async(run()), Song)
+
+
+class TestAsyncSave(AsyncTestCase):
+    """
+    Test saving songs on the native worker pool.
+
+    """
+    @cleanup('out_async.flac')
+    def test_with_filename(self, filename):
+        """
+        Test saving the file asynchronously to a different location.
+
+        """
+        song = Song(testfile)
+        song['artist'] = 'MaSu'
+
+        async def run():
+            await song.save_async(filename=filename)
+        self.run_async(run())
+        copy = Song(filename)
+        self.assertEqual(copy['artist'], 'MaSu')
+
+    @cleanup('out_async_busy.flac')
+    def test_busy(self, filename):
+        """
+        Test a song can not be modified while it is being saved.
+
+        """
+        song = Song(testfile)
+
+        async def run():
+            future = song.save_async(filename=filename)
+            with self.assertRaises(RuntimeError):
+                song['artist'] = 'MaSu'
+            await future
+            song['artist'] = 'MaSu'
+        self.run_async(run())
+        self.assertEqual(song['artist'], 'MaSu')
+
+    @cleanup('out_async_exit.flac')
+    def test_exit_busy(self, filename):
+        """
+        Test leaving a with block while a save is running keeps the
+        exception of the block, and closes the song after the save.
+
+        """
+        async def run():
+            with self.assertRaises(KeyError):
+                with Song(testfile) as song:
+                    future = song.save_async(filename=filename)
+                    raise KeyError('artist')
+            self.assertFalse(song.closed)
+            await future
+            self.assertTrue(song.closed)
+            self.assertTrue(os.path.isfile(filename))
+        self.run_async(run())
+
+    @cleanup('out_async_cancel.flac')
+    def test_cancel_running(self, filename):
+        """
+        Test cancelling a save which is being written interrupts it, and
+        a later save writes the complete song.
+
+        """
+        song = Song(testfile)
+        before = set(os.listdir('.'))
+
+        def tmpfiles():
+            return [f for f in set(os.listdir('.')) - before
+                    if f.startswith('.')]
+
+        async def run():
+            # Keep the save running after it created its temporary file.
+            audiolayer._hold_saves(True)
+            self.addCleanup(audiolayer._hold_saves, False)
+            future = song.save_async(filename=filename)
+            deadline = self.loop.time() + 10
+            while not tmpfiles():
+                self.assertLess(self.loop.time(), deadline, 'Save not run.')
+                await asyncio.sleep(0.001)
+            self.assertFalse(future.done())
+            self.assertTrue(future.cancel())
+            with self.assertRaises(asyncio.CancelledError):
+                await future
+            await self.wait_idle(song)
+            self.assertEqual(tmpfiles(), [])
+            self.assertFalse(os.path.exists(filename))
+
+            audiolayer._hold_saves(False)
+            song.save(filename=filename)
+            self.assertEqual(await self.decode(Song(filename)),
+                             await self.decode(Song(testfile)))
+        self.run_async(run())
+
+
+class TestAsyncBlocks(AsyncTestCase):
+    """
+    Test decoding the audio stream on the native worker pool.
+
+    """
+    def test_blocks(self):
+        """
+        Test all decoded blocks together contain the whole audio stream.
+
+        """
+        song = Song(testfile)
+
+        async def run():
+            size = 0
+            async for block in song.blocks():
+                self.assertIsInstance(block, bytes)
+                size += len(block)
+            return size
+        size = self.run_async(run())
+        samples = size / song.bytes_per_sample / song.channels
+        self.assertAlmostEqual(samples / song.sample_rate, song.duration, 1)
+
+    def test_cancel(self):
+        """
+        Test cancelling decoding after the first block leaves the song
+        idle, and decoding it again starts at the beginning.
+
+        """
+        song = Song(testfile)
+
+        async def run():
+            blocks = song.blocks()
+            first = await blocks.__anext__()
+            future = blocks.__anext__()
+            future.cancel()
+            with self.assertRaises(asyncio.CancelledError):
+                await future
+            await self.wait_idle(song)
+            data = await self.decode(song)
+            self.assertTrue(data.startswith(first))
+            self.assertEqual(data, await self.decode(Song(testfile)))
+        self.run_async(run())
+
+    @cleanup('silence.mp3')
+    def test_drain(self, filename):
+        """
+        Test the frames delayed by the decoder are decoded at the end of a
+        stream, so the whole stream is returned.
+
+        """
+        with open(filename, 'wb') as f:
+            f.write(mp3(100))
+        song = Song(filename)
+        data = self.run_async(self.decode(song))
+        self.assertEqual(len(data), 100 * 1152 * song.channels *
+                         song.bytes_per_sample)
+
+    @cleanup('out_blocks_stale.flac')
+    def test_stale(self, filename):
+        """
+        Test an iterator raises once another operation read the song.
+
+        """
+        song = Song(testfile)
+
+        async def run():
+            blocks = song.blocks()
+            await blocks.__anext__()
+            song.save(filename=filename)
+            with self.assertRaises(RuntimeError):
+                await blocks.__anext__()
+
+            blocks = song.blocks()
+            await blocks.__anext__()
+            other = song.blocks()
+            with self.assertRaises(RuntimeError):
+                await blocks.__anext__()
+            first = await Song(testfile).blocks().__anext__()
+            self.assertEqual(await other.__anext__(), first)
+        self.run_async(run())
+
+    def test_sample_format(self):
+        """
+        Test the format of the decoded samples is exposed.
+
+        """
+        song = Song(testfile)
+        self.assertEqual(song.sample_format, 's16')
+        self.assertEqual(song.bytes_per_sample, 2)
+        song.close()
+        with self.assertRaises(ValueError):
+            song.sample_format
+
+
 if __name__ == '__main__':
     unittest.main()